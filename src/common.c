@@ -26,10 +26,21 @@
 //    http://nlp.stanford.edu/projects/glove/
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "common.h"
 
+#ifndef CORPUS_BUFFER_SIZE
+#define CORPUS_BUFFER_SIZE 16777216 // read buffer for corpora that cannot be mapped, e.g. pipes
+#endif
+
 #ifdef _MSC_VER
 #define STRERROR(ERRNO, BUF, BUFSIZE) strerror_s((BUF), (BUFSIZE), (ERRNO))
 #else
@@ -42,68 +53,677 @@ int scmp( char *s1, char *s2 ) {
     return (*s1 - *s2);
 }
 
-/* Move-to-front hashing and hash function from Hugh Williams, http://www.seg.rmit.edu.au/code/zwh-ipl/ */
+/* Compare null-terminated s1 with the len bytes at s2 (which need not be null-terminated) */
+int sncmp( char *s1, char *s2, int len ) {
+    int c = strncmp(s1, s2, len);
+    return c != 0 ? c : (unsigned char) s1[len];
+}
 
-/* Simple bitwise hash function */
-unsigned int bitwisehash(char *word, int tsize, unsigned int seed) {
-    char c;
-    unsigned int h;
-    h = seed;
-    for ( ; (c = *word) != '\0'; word++) h ^= ((h << 5) + c + (h >> 2));
-    return (unsigned int)((h & 0x7fffffff) % tsize);
+/* Allocate an arena of capacity bytes (grown on demand). Returns 0 on success, 1 if out of memory. */
+int arena_init(ARENA *arena, long long capacity) {
+    arena->size = 0;
+    arena->capacity = capacity > 0 ? capacity : 1;
+    arena->data = (char *) malloc(arena->capacity);
+    return arena->data == NULL;
 }
 
-/* Create hash table, initialise pointers to NULL */
-HASHREC ** inithashtable() {
-    int i;
-    HASHREC **ht;
-    ht = (HASHREC **) malloc( sizeof(HASHREC *) * TSIZE );
-    for (i = 0; i < TSIZE; i++) ht[i] = (HASHREC *) NULL;
+/* Append the len bytes at w, null-terminated, to the arena. Returns their offset, or -1 if out of memory or
+   if the arena would outgrow the 32-bit offsets used to refer to words. Pointers into the arena are
+   invalidated by appends; offsets are not. */
+long long arena_add(ARENA *arena, char *w, int len) {
+    long long offset = arena->size, capacity;
+    char *data;
+    if (offset + len + 1 > 4294967296LL) return -1;
+    if (offset + len + 1 > arena->capacity) {
+        for (capacity = arena->capacity; offset + len + 1 > capacity; capacity *= 2);
+        if (capacity > 4294967296LL) capacity = 4294967296LL;
+        if ((data = (char *) realloc(arena->data, capacity)) == NULL) return -1;
+        arena->data = data;
+        arena->capacity = capacity;
+    }
+    memcpy(arena->data + offset, w, len);
+    arena->data[offset + len] = '\0';
+    arena->size += len + 1;
+    return offset;
+}
+
+void arena_free(ARENA *arena) {
+    free(arena->data);
+    arena->data = NULL;
+    arena->size = arena->capacity = 0;
+}
+
+/* MurmurHash64A by Austin Appleby (public domain) over the first len bytes of word; never returns 0 */
+unsigned long long wordhash(char *word, int len) {
+    const unsigned long long m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    unsigned long long h = SEED ^ (len * m), k;
+    const unsigned char *tail;
+
+    for ( ; len >= 8; word += 8, len -= 8) {
+        memcpy(&k, word, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    tail = (const unsigned char *) word;
+    switch (len) {
+        case 7: h ^= (unsigned long long) tail[6] << 48; /* fall through */
+        case 6: h ^= (unsigned long long) tail[5] << 40; /* fall through */
+        case 5: h ^= (unsigned long long) tail[4] << 32; /* fall through */
+        case 4: h ^= (unsigned long long) tail[3] << 24; /* fall through */
+        case 3: h ^= (unsigned long long) tail[2] << 16; /* fall through */
+        case 2: h ^= (unsigned long long) tail[1] << 8; /* fall through */
+        case 1: h ^= (unsigned long long) tail[0];
+                h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h != 0 ? h : 1;
+}
+
+/* Create hash table with at least size slots */
+HASHTABLE *hashtable_create(long long size) {
+    HASHTABLE *ht = (HASHTABLE *) malloc(sizeof(HASHTABLE));
+    if (ht == NULL) return NULL;
+    for (ht->size = 1; ht->size < size; ht->size <<= 1);
+    ht->count = 0;
+    ht->slots = (HASHENTRY *) calloc(ht->size, sizeof(HASHENTRY));
+    if (ht->slots == NULL) {free(ht); return NULL;}
+    if (arena_init(&ht->words, 8 * ht->size) != 0) {free(ht->slots); free(ht); return NULL;}
     return ht;
 }
 
-/* Read word from input stream. Return 1 when encounter '\n' or EOF (but separate from word), 0 otherwise.
+/* Double the number of slots, reinserting entries by their stored hashes */
+static int hashtable_grow(HASHTABLE *ht) {
+    long long a, b, mask = 2 * ht->size - 1;
+    HASHENTRY *slots = (HASHENTRY *) calloc(2 * ht->size, sizeof(HASHENTRY));
+    if (slots == NULL) return 1;
+    for (a = 0; a < ht->size; a++) {
+        if (ht->slots[a].hash == 0) continue;
+        for (b = ht->slots[a].hash & mask; slots[b].hash != 0; b = (b + 1) & mask);
+        slots[b] = ht->slots[a];
+    }
+    free(ht->slots);
+    ht->slots = slots;
+    ht->size *= 2;
+    return 0;
+}
+
+/* Search hash table for given string of length len, return entry if found, else NULL */
+HASHENTRY *hashtable_search(HASHTABLE *ht, char *w, int len) {
+    unsigned long long h = wordhash(w, len);
+    long long a, mask = ht->size - 1;
+    for (a = h & mask; ht->slots[a].hash != 0; a = (a + 1) & mask) {
+        if (ht->slots[a].hash == h && sncmp(HASHWORD(ht, &ht->slots[a]), w, len) == 0) return &ht->slots[a];
+    }
+    return NULL;
+}
+
+/* Search hash table for given string of length len, inserting it with num = 0 if not found.
+   Returns the entry, which stays valid until the next insertion, or NULL if out of memory. */
+HASHENTRY *hashtable_insert(HASHTABLE *ht, char *w, int len) {
+    unsigned long long h = wordhash(w, len);
+    long long a, mask, offset;
+    if (2 * (ht->count + 1) > ht->size && hashtable_grow(ht) != 0) return NULL; // keep load factor at most 1/2
+    mask = ht->size - 1;
+    for (a = h & mask; ht->slots[a].hash != 0; a = (a + 1) & mask) {
+        if (ht->slots[a].hash == h && sncmp(HASHWORD(ht, &ht->slots[a]), w, len) == 0) return &ht->slots[a];
+    }
+    if ((offset = arena_add(&ht->words, w, len)) < 0) return NULL;
+    ht->slots[a].word = (unsigned int) offset;
+    ht->slots[a].hash = h;
+    ht->slots[a].num = 0;
+    ht->count++;
+    return &ht->slots[a];
+}
+
+/* Remove all words, keeping the allocated slots and arena for reuse */
+void hashtable_clear(HASHTABLE *ht) {
+    memset(ht->slots, 0, sizeof(HASHENTRY) * ht->size);
+    ht->count = 0;
+    ht->words.size = 0;
+}
+
+void hashtable_free(HASHTABLE *ht) {
+    if (ht == NULL) return;
+    arena_free(&ht->words);
+    free(ht->slots);
+    free(ht);
+}
+
+/* Num of word w in ht, or 0 if w is absent; a lookup for phrase_subtokens */
+long long hashtable_num(void *ht, char *w, int len) {
+    HASHENTRY *htmp = hashtable_search((HASHTABLE *) ht, w, len);
+    return htmp != NULL ? htmp->num : 0;
+}
+
+/* Look up the subtokens of phrase w, i.e. each nonempty piece of w followed by SEP_CHAR, with lookup(vocab, piece, len),
+   and store the nonzero results in ids, which must hold len / 2 entries. Returns the number of ids stored. */
+int phrase_subtokens(char *w, int len, long long (*lookup)(void *, char *, int), void *vocab, int *ids) {
+    int n = 0;
+    long long id;
+    char *end;
+    for (; (end = (char *) memchr(w, SEP_CHAR, len)) != NULL; len -= end + 1 - w, w = end + 1) {
+        if (end > w && (id = lookup(vocab, w, end - w)) != 0) ids[n++] = id;
+    }
+    return n;
+}
+
+/* Slot of a word with hash h in a minimal perfect hash of size slots, given the displacement d of its bucket */
+static long long bvocab_slot(unsigned long long h, unsigned int d, long long size) {
+    if (d & BVOCAB_DIRECT) return d & ~BVOCAB_DIRECT;
+    h ^= d * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h % size;
+}
+
+/* Write the size words (in rank order) and their counts as a binary vocabulary, building its minimal perfect hash:
+   words are hashed into buckets of about 2, and each bucket gets the first displacement that moves all of its words
+   to free slots; buckets of one word are stored directly in a remaining free slot. Returns 1 on failure, 0 otherwise. */
+int bvocab_write(char *file_name, char **words, long long *counts, long long size) {
+    long long a, b, k, num_buckets = size / 2 + 1, pool_bytes = 0, offset, next_free = 0, header[4] = {0, 0, 0, 0};
+    unsigned long long *hashes = malloc(sizeof(unsigned long long) * (size + 1));
+    long long *bucket_start = calloc(num_buckets + 1, sizeof(long long)), *order = malloc(sizeof(long long) * num_buckets);
+    long long *members = malloc(sizeof(long long) * (size + 1)), *fill = calloc(num_buckets, sizeof(long long));
+    long long *by_size = calloc(size + 2, sizeof(long long));
+    unsigned int d, *displace = calloc(num_buckets, sizeof(unsigned int)), *slots = malloc(sizeof(unsigned int) * (size + 1));
+    char *taken = calloc(size + 1, 1), padding[8] = {0};
+    int status = 0;
+    FILE *fout;
+
+    if (hashes == NULL || bucket_start == NULL || order == NULL || members == NULL || fill == NULL || by_size == NULL || displace == NULL || slots == NULL || taken == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!\n");
+        status = 1;
+    }
+    else if (size >= BVOCAB_DIRECT) {
+        fprintf(stderr, "Too many words for a binary vocabulary.\n");
+        status = 1;
+    }
+    for (a = 0; status == 0 && a < size; a++) {
+        hashes[a] = wordhash(words[a], strlen(words[a]));
+        bucket_start[(hashes[a] >> 32) % num_buckets + 1]++;
+        pool_bytes += strlen(words[a]) + 1;
+    }
+    if (status == 0) {
+        // Group words by bucket, then place the buckets from largest to smallest
+        for (b = 0; b < num_buckets; b++) {bucket_start[b + 1] += bucket_start[b]; order[b] = b;}
+        for (a = 0; a < size; a++) {
+            b = (hashes[a] >> 32) % num_buckets;
+            members[bucket_start[b] + fill[b]++] = a;
+        }
+        for (b = 0; b < num_buckets; b++) by_size[bucket_start[b + 1] - bucket_start[b]]++; // counting sort by size
+        for (k = size; k > 0; k--) by_size[k - 1] += by_size[k];
+        for (b = num_buckets - 1; b >= 0; b--) order[--by_size[bucket_start[b + 1] - bucket_start[b]]] = b;
+    }
+    for (k = 0; status == 0 && k < num_buckets; k++) {
+        b = order[k];
+        if (bucket_start[b + 1] - bucket_start[b] == 0) break;
+        if (bucket_start[b + 1] - bucket_start[b] == 1) {
+            while (taken[next_free]) next_free++;
+            displace[b] = BVOCAB_DIRECT | next_free;
+            taken[next_free] = 1;
+            slots[next_free] = members[bucket_start[b]];
+            continue;
+        }
+        for (d = 0; d < BVOCAB_DIRECT; d++) {
+            for (a = bucket_start[b]; a < bucket_start[b + 1]; a++) {
+                offset = bvocab_slot(hashes[members[a]], d, size);
+                if (taken[offset]) break;
+                taken[offset] = 1;
+            }
+            if (a == bucket_start[b + 1]) break;
+            while (a-- > bucket_start[b]) taken[bvocab_slot(hashes[members[a]], d, size)] = 0; // undo
+            if (d == 16777216) {
+                fprintf(stderr, "Couldn't build a perfect hash; are there duplicate words?\n");
+                status = 1;
+                break;
+            }
+        }
+        displace[b] = d;
+        for (a = bucket_start[b]; a < bucket_start[b + 1]; a++) slots[bvocab_slot(hashes[members[a]], d, size)] = members[a];
+    }
+
+    if (status == 0 && (fout = fopen(file_name, "wb")) == NULL) {
+        log_file_loading_error("binary vocab file", file_name);
+        status = 1;
+    }
+    if (status == 0) {
+        memcpy(header, BVOCAB_MAGIC, 8);
+        header[1] = size;
+        header[2] = num_buckets;
+        header[3] = pool_bytes;
+        fwrite(header, sizeof(long long), 4, fout);
+        fwrite(counts, sizeof(long long), size, fout);
+        for (a = 0, offset = 0; a < size; a++) {
+            fwrite(&offset, sizeof(long long), 1, fout);
+            offset += strlen(words[a]) + 1;
+        }
+        fwrite(displace, sizeof(unsigned int), num_buckets, fout);
+        fwrite(slots, sizeof(unsigned int), size, fout);
+        fwrite(padding, 1, (8 - (num_buckets + size) * sizeof(unsigned int) % 8) % 8, fout);
+        for (a = 0; a < size; a++) fwrite(words[a], 1, strlen(words[a]) + 1, fout);
+        if (fclose(fout) != 0) status = 1;
+    }
+    free(hashes); free(bucket_start); free(order); free(members); free(fill); free(by_size); free(displace); free(slots); free(taken);
+    return status;
+}
+
+/* Map a binary vocabulary written by bvocab_write. Returns 0 on success, 1 if the file is not a binary vocabulary
+   (so it may be read as text), -1 if it cannot be opened. */
+int bvocab_open(BINVOCAB *v, char *file_name) {
+    struct stat st;
+    long long header[4], expected, a;
+    int corrupt;
+    FILE *fid = fopen(file_name, "rb");
+    void *map;
+
+    memset(v, 0, sizeof(BINVOCAB));
+    if (fid == NULL) return -1;
+    if (fread(header, sizeof(long long), 4, fid) != 4 || memcmp(header, BVOCAB_MAGIC, 8) != 0 || fstat(fileno(fid), &st) != 0) {
+        fclose(fid);
+        return 1;
+    }
+    // Each part is bounded by the file size before the parts are added up, so the sum can't overflow
+    if (header[1] < 0 || header[2] < 0 || header[3] < 0 || (header[1] > 0 && header[2] == 0)
+        || header[1] > st.st_size / (2 * (long long) sizeof(long long)) || header[2] > st.st_size / (long long) sizeof(unsigned int) || header[3] > st.st_size) expected = -1;
+    else expected = 4 * sizeof(long long) + 2 * header[1] * sizeof(long long) + ((header[1] + header[2]) * sizeof(unsigned int) + 7) / 8 * 8 + header[3];
+    map = (st.st_size == expected) ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(fid), 0) : MAP_FAILED;
+    fclose(fid);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Binary vocab file %s is corrupt.\n", file_name);
+        return -1;
+    }
+    v->data = (char *) map;
+    v->bytes = st.st_size;
+    v->size = header[1];
+    v->num_buckets = header[2];
+    v->counts = (long long *) (v->data + 4 * sizeof(long long));
+    v->offsets = v->counts + v->size;
+    v->displace = (unsigned int *) (v->offsets + v->size);
+    v->slots = v->displace + v->num_buckets;
+    v->pool = v->data + expected - header[3];
+    // Every word lookup must stay in the pool: direct displacements and slots naming words, offsets inside the pool,
+    // a terminator at its end
+    corrupt = header[3] > 0 && v->pool[header[3] - 1] != '\0';
+    for (a = 0; a < v->num_buckets && !corrupt; a++) {
+        corrupt = (v->displace[a] & BVOCAB_DIRECT) && (v->displace[a] & ~BVOCAB_DIRECT) >= (unsigned long long) v->size;
+    }
+    for (a = 0; a < v->size && !corrupt; a++) {
+        corrupt = v->offsets[a] < 0 || v->offsets[a] >= header[3] || v->slots[a] >= v->size;
+    }
+    if (corrupt) {
+        fprintf(stderr, "Binary vocab file %s is corrupt.\n", file_name);
+        bvocab_close(v);
+        return -1;
+    }
+    return 0;
+}
+
+/* Frequency rank (from 1) of word w in v, or 0 if w is not in v */
+long long bvocab_search(BINVOCAB *v, char *w, int len) {
+    unsigned long long h;
+    long long a;
+    char *word;
+    if (v->size == 0) return 0;
+    h = wordhash(w, len);
+    a = v->slots[bvocab_slot(h, v->displace[(h >> 32) % v->num_buckets], v->size)];
+    word = v->pool + v->offsets[a];
+    return (strncmp(word, w, len) == 0 && word[len] == '\0') ? a + 1 : 0; // strncmp stops at the end of a shorter word
+}
+
+void bvocab_close(BINVOCAB *v) {
+    if (v->data != NULL) munmap(v->data, v->bytes);
+    v->data = NULL;
+}
+
+/* Open a corpus for tokenizing; file_name NULL reads stdin. Regular files (including stdin redirected from
+   a file) are mapped into memory, anything else is read through a large buffer.
+   Returns 0 on success, 1 if the file cannot be opened. */
+int corpus_open(CORPUSREADER *r, char *file_name) {
+    struct stat st;
+    void *map;
+    long long start;
+
+    memset(r, 0, sizeof(CORPUSREADER));
+    r->owner = 1;
+    r->fin = (file_name == NULL) ? stdin : fopen(file_name, "rb");
+    if (r->fin == NULL) return 1;
+    if (fstat(fileno(r->fin), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(r->fin), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            start = lseek(fileno(r->fin), 0, SEEK_CUR);
+            r->data = (char *) map;
+            r->size = r->end = st.st_size;
+            r->pos = (start > 0 && start < st.st_size) ? start : 0;
+            r->mapped = 1;
+            r->eof = 1;
+            return 0;
+        }
+    }
+    r->data = (char *) malloc(CORPUS_BUFFER_SIZE);
+    if (r->data == NULL) {
+        if (r->fin != stdin) fclose(r->fin);
+        return 1;
+    }
+    r->size = CORPUS_BUFFER_SIZE;
+    return 0;
+}
+
+/* Make view tokenize only the bytes [start, end) of the mapped corpus r; view shares r's mapping */
+void corpus_view(CORPUSREADER *view, CORPUSREADER *r, long long start, long long end) {
+    memcpy(view, r, sizeof(CORPUSREADER));
+    view->owner = 0;
+    view->fin = NULL;
+    view->pos = start;
+    view->end = end;
+}
+
+/* Split the rest of a mapped corpus into num ranges starting at starts[0..num-1] and ending at starts[num].
+   Boundaries are moved forward to just after a newline, so no document is split; ranges may be empty.
+   Returns 0 on success, 1 if r is not mapped (e.g. a pipe) and so cannot be split. */
+long long corpus_split(CORPUSREADER *r, int num, long long *starts) {
+    long long a, length = r->end - r->pos;
+    char *nl;
+
+    if (!r->mapped) return 1;
+    starts[0] = r->pos;
+    starts[num] = r->end;
+    for (a = 1; a < num; a++) {
+        starts[a] = r->pos + length / num * a;
+        if (starts[a] < starts[a - 1]) starts[a] = starts[a - 1];
+        if (starts[a] == r->pos) continue;
+        nl = memchr(r->data + starts[a] - 1, '\n', r->end - starts[a] + 1);
+        starts[a] = (nl == NULL) ? r->end : nl - r->data + 1;
+    }
+    return 0;
+}
+
+/* Index of the first space, tab, newline or carriage return in data[pos, end), or end if there is none */
+static long long find_delimiter(const char *data, long long pos, long long end) {
+    char c;
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    __m128i x;
+    int mask;
+    for ( ; pos + 16 <= end; pos += 16) {
+        x = _mm_loadu_si128((const __m128i *) (data + pos));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, sp), _mm_cmpeq_epi8(x, tab)),
+                                              _mm_or_si128(_mm_cmpeq_epi8(x, nl), _mm_cmpeq_epi8(x, cr))));
+        if (mask != 0) return pos + __builtin_ctz(mask);
+    }
+#endif
+    for ( ; pos < end; pos++) {
+        c = data[pos];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return pos;
+    }
+    return end;
+}
+
+/* Stream input only: move data[keep, end) to the front of the buffer and read more after it.
+   Returns the number of bytes read; sets eof once the stream is exhausted. */
+static long long corpus_fill(CORPUSREADER *r, long long keep) {
+    long long n;
+    if (r->mapped || r->eof) return 0;
+    memmove(r->data, r->data + keep, r->end - keep);
+    r->offset += keep;
+    r->pos -= keep;
+    r->end -= keep;
+    n = fread(r->data + r->end, 1, r->size - r->end, r->fin);
+    r->end += n;
+    if (n == 0) r->eof = 1;
+    return n;
+}
+
+/* Copy up to MAX_STRING_LENGTH - 1 bytes of data[s, e), dropping carriage returns, to dst starting at dst[n] */
+static int copy_word(char *dst, int n, const char *data, long long s, long long e) {
+    for ( ; s < e && n < MAX_STRING_LENGTH - 1; s++) if (data[s] != '\r') dst[n++] = data[s];
+    return n;
+}
+
+/* Read the next token. Returns 0 and sets word/len to the token, 1 at a newline, or EOF at the end of the input.
    Words can be separated by space(s), tab(s), or newline(s). Carriage return characters are just ignored.
    (Okay for Windows, but not for Mac OS 9-. Ignored even if by themselves or in words.)
    A newline is taken as indicating a new document (contexts won't cross newline).
-   Argument word array is assumed to be of size MAX_STRING_LENGTH.
-   words will be truncated if too long. They are truncated with some care so that they
+   The token is a view into the mapping or read buffer (or the reader's scratch buffer when carriage returns had
+   to be removed); it is not null-terminated and stays valid only until the next call.
+   Words are truncated to MAX_STRING_LENGTH - 1 bytes. They are truncated with some care so that they
    cannot truncate in the middle of a utf-8 character, but
    still little to no harm will be done for other encodings like iso-8859-1.
-   (This function appears identically copied in vocab_count.c and cooccur.c.)
  */
-int get_word(char *word, FILE *fin) {
-    int i = 0, ch;
+int corpus_next_token(CORPUSREADER *r, char **word, int *len) {
+    long long s, e;
+    int has_cr, n;
+    char c, *w;
+
     for ( ; ; ) {
-        ch = fgetc(fin);
-        if (ch == '\r') continue;
-        if (i == 0 && ((ch == '\n') || (ch == EOF))) {
-            word[i] = 0;
+        // skip leading space (and carriage returns, which are ignored)
+        while (r->pos < r->end && ((c = r->data[r->pos]) == ' ' || c == '\t' || c == '\r')) r->pos++;
+        if (r->pos == r->end) {
+            if (corpus_fill(r, r->pos) > 0) continue;
+            *word = r->word;
+            *len = 0;
+            return EOF;
+        }
+        if (r->data[r->pos] == '\n') {
+            r->pos++;
+            *word = r->word;
+            *len = 0;
             return 1;
         }
-        if (i == 0 && ((ch == ' ') || (ch == '\t'))) continue; // skip leading space
-        if ((ch == EOF) || (ch == ' ') || (ch == '\t') || (ch == '\n')) {
-            if (ch == '\n') ungetc(ch, fin); // return the newline next time as document ender
-            break;
+        s = e = r->pos;
+        has_cr = 0;
+        n = -1;
+        for ( ; ; ) {
+            e = find_delimiter(r->data, e, r->end);
+            if (e < r->end && r->data[e] == '\r') {
+                has_cr = 1;
+                e++;
+                continue;
+            }
+            if (e < r->end || r->eof || r->mapped) break;
+            // Token runs past the buffered data: keep it and read more
+            if (s == 0 && r->end == r->size) {
+                // Token longer than the whole read buffer: keep its head in scratch, discard the rest
+                n = copy_word(r->word, n < 0 ? 0 : n, r->data, s, e);
+                has_cr = 1;
+                s = e;
+            }
+            e -= s;
+            r->pos = s;
+            corpus_fill(r, s);
+            s = 0;
         }
-        if (i < MAX_STRING_LENGTH - 1)
-          word[i++] = ch; // don't allow words to exceed MAX_STRING_LENGTH
-    }
-    word[i] = 0; //null terminate
-    // avoid truncation destroying a multibyte UTF-8 char except if only thing on line (so the i > x tests won't overwrite word[0])
-    // see https://en.wikipedia.org/wiki/UTF-8#Description
-    if (i == MAX_STRING_LENGTH - 1 && (word[i-1] & 0x80) == 0x80) {
-        if ((word[i-1] & 0xC0) == 0xC0) {
-            word[i-1] = '\0';
-        } else if (i > 2 && (word[i-2] & 0xE0) == 0xE0) {
-            word[i-2] = '\0';
-        } else if (i > 3 && (word[i-3] & 0xF8) == 0xF0) {
-            word[i-3] = '\0';
+        r->pos = e;
+        if (has_cr) {
+            w = r->word;
+            n = copy_word(w, n < 0 ? 0 : n, r->data, s, e);
+            if (n == 0) continue; // only carriage returns
         }
+        else {
+            w = r->data + s;
+            n = (e - s < MAX_STRING_LENGTH - 1) ? e - s : MAX_STRING_LENGTH - 1;
+        }
+        // avoid truncation destroying a multibyte UTF-8 char except if only thing on line
+        // see https://en.wikipedia.org/wiki/UTF-8#Description
+        if (n == MAX_STRING_LENGTH - 1 && (w[n-1] & 0x80) == 0x80) {
+            if ((w[n-1] & 0xC0) == 0xC0) {
+                n -= 1;
+            } else if (n > 2 && (w[n-2] & 0xE0) == 0xE0) {
+                n -= 2;
+            } else if (n > 3 && (w[n-3] & 0xF8) == 0xF0) {
+                n -= 3;
+            }
+        }
+        *word = w;
+        *len = n;
+        return 0;
+    }
+}
+
+/* File offset of the next byte the reader will scan */
+long long corpus_offset(CORPUSREADER *r) {
+    return r->offset + r->pos;
+}
+
+void corpus_close(CORPUSREADER *r) {
+    if (r->owner) {
+        if (r->mapped) munmap(r->data, r->size);
+        else free(r->data);
+        if (r->fin != NULL && r->fin != stdin) fclose(r->fin);
+    }
+    r->data = NULL;
+}
+
+/* Open a file of cooccurrence records for reading through a buffer of size records. Returns 1 on failure, 0 otherwise. */
+int crec_reader_open(CRECREADER *r, char *file_name, long long size) {
+    r->buf = NULL;
+    r->pos = r->end = r->offset = 0;
+    r->remaining = -1;
+    r->size = size < 1 ? 1 : size;
+    r->fill = NULL;
+    if ((r->fid = fopen(file_name, "rb")) == NULL) return 1;
+    if ((r->buf = (CREC *) malloc(sizeof(CREC) * r->size)) == NULL) {
+        fclose(r->fid);
+        r->fid = NULL;
+        return 1;
     }
+    setvbuf(r->fid, NULL, _IONBF, 0); // reads are already a block at a time
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fileno(r->fid), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
     return 0;
 }
 
+/* Read count records made by fill(source, out, n), which copies up to n next records to out and returns the number
+   copied, through a buffer of size records. Returns 1 on failure, 0 otherwise. */
+int crec_reader_generate(CRECREADER *r, long long (*fill)(void *, CREC *, long long), void *source, long long count, long long size) {
+    r->fid = NULL;
+    r->pos = r->end = r->offset = 0;
+    r->remaining = count;
+    r->size = size < 1 ? 1 : size;
+    r->fill = fill;
+    r->source = source;
+    return (r->buf = (CREC *) malloc(sizeof(CREC) * r->size)) == NULL;
+}
+
+/* Refill the buffer with the next block and ask the kernel to start reading the one after; returns records read */
+static long long crec_reader_fill(CRECREADER *r) {
+    long long n = r->remaining >= 0 && r->remaining < r->size ? r->remaining : r->size;
+    r->pos = 0;
+    if (r->fill != NULL) r->end = n > 0 ? r->fill(r->source, r->buf, n) : 0;
+    else r->end = n > 0 ? (long long) fread(r->buf, sizeof(CREC), n, r->fid) : 0;
+    r->offset += r->end * (long long) sizeof(CREC);
+    if (r->remaining >= 0) r->remaining -= r->end;
+    if (r->fill != NULL) return r->end;
+#ifdef POSIX_FADV_WILLNEED
+    if (r->end == r->size && r->remaining != 0) posix_fadvise(fileno(r->fid), r->offset, r->size * sizeof(CREC), POSIX_FADV_WILLNEED);
+#endif
+    return r->end;
+}
+
+/* Restrict the reader to the count records from record start on. Returns 1 on failure, 0 otherwise. */
+int crec_reader_seek(CRECREADER *r, long long start, long long count) {
+    r->pos = r->end = 0;
+    r->offset = start * (long long) sizeof(CREC);
+    r->remaining = count;
+    return fseeko(r->fid, r->offset, SEEK_SET) != 0;
+}
+
+/* Copy up to n next records to out; returns the number copied, less than n only at the end of the file */
+long long crec_reader_read(CRECREADER *r, CREC *out, long long n) {
+    long long k, got = 0;
+    while (got < n) {
+        if (r->pos == r->end && crec_reader_fill(r) == 0) break;
+        k = r->end - r->pos < n - got ? r->end - r->pos : n - got;
+        memcpy(out + got, r->buf + r->pos, sizeof(CREC) * k);
+        r->pos += k;
+        got += k;
+    }
+    return got;
+}
+
+void crec_reader_close(CRECREADER *r) {
+    if (r->fid != NULL) fclose(r->fid);
+    free(r->buf);
+    r->fid = NULL;
+    r->buf = NULL;
+}
+
+/* Order of two merge sources by their heads: by word1, then word2, then source, so that equal records come out in
+   source order; exhausted sources come last */
+static int crec_merge_less(CRECMERGER *m, int a, int b) {
+    CREC *x = &m->heads[a], *y = &m->heads[b];
+    if (!m->live[b]) return m->live[a] || a < b;
+    if (!m->live[a]) return 0;
+    if (x->word1 != y->word1) return x->word1 < y->word1;
+    if (x->word2 != y->word2) return x->word2 < y->word2;
+    return a < b;
+}
+
+/* Play the matches below internal node n, leaving losers in the tree; returns the winner. Leaves are nodes num .. 2 * num - 1. */
+static int crec_merge_build(CRECMERGER *m, int n) {
+    int a, b;
+    if (n >= m->num) return n - m->num;
+    a = crec_merge_build(m, 2 * n);
+    b = crec_merge_build(m, 2 * n + 1);
+    if (crec_merge_less(m, a, b)) {m->tree[n] = b; return a;}
+    m->tree[n] = a;
+    return b;
+}
+
+/* Start merging num sorted sources, which must be open. Returns 1 on failure, 0 otherwise. */
+int crec_merge_init(CRECMERGER *m, CRECREADER *sources, int num) {
+    int i;
+    m->num = num;
+    m->sources = sources;
+    m->heads = (CREC *) malloc(sizeof(CREC) * (num + 1));
+    m->live = (int *) malloc(sizeof(int) * (num + 1));
+    m->tree = (int *) malloc(sizeof(int) * (num + 1));
+    if (m->heads == NULL || m->live == NULL || m->tree == NULL) {
+        crec_merge_free(m);
+        return 1;
+    }
+    for (i = 0; i < num; i++) m->live[i] = crec_reader_read(&sources[i], &m->heads[i], 1) == 1;
+    m->tree[0] = num > 1 ? crec_merge_build(m, 1) : 0;
+    return 0;
+}
+
+/* Take the smallest record of all sources into c. Returns 0 when all sources are exhausted, 1 otherwise. */
+int crec_merge_next(CRECMERGER *m, CREC *c) {
+    int n, t, w = m->tree[0];
+    if (m->num == 0 || !m->live[w]) return 0;
+    *c = m->heads[w];
+    CRECREADER *r = &m->sources[w];
+    if (r->pos < r->end) m->heads[w] = r->buf[r->pos++];
+    else m->live[w] = crec_reader_read(r, &m->heads[w], 1) == 1;
+    // Replay the matches on the path from w's leaf to the root
+    for (n = (w + m->num) / 2; n > 0; n /= 2) {
+        if (crec_merge_less(m, m->tree[n], w)) {
+            t = m->tree[n];
+            m->tree[n] = w;
+            w = t;
+        }
+    }
+    m->tree[0] = w;
+    return 1;
+}
+
+void crec_merge_free(CRECMERGER *m) {
+    free(m->heads);
+    free(m->live);
+    free(m->tree);
+    m->heads = NULL;
+    m->live = m->tree = NULL;
+}
+
 int find_arg(char *str, int argc, char **argv) {
     int i;
     for (i = 1; i < argc; i++) {
@@ -118,22 +738,6 @@ int find_arg(char *str, int argc, char **argv) {
     return -1;
 }
 
-void free_table(HASHREC **ht) {
-    int i;
-    HASHREC* current;
-    HASHREC* tmp;
-    for (i = 0; i < TSIZE; i++) {
-        current = ht[i];
-        while (current != NULL) {
-            tmp = current;
-            current = current->next;
-            free(tmp->word);
-            free(tmp);
-        }
-    }
-    free(ht);
-}
-
 void free_fid(FILE **fid, const int num) {
     int i;
     for(i = 0; i < num; i++) {
@@ -31,10 +31,9 @@
 #include <stdio.h>
 
 #define MAX_STRING_LENGTH 1000
-#define TSIZE 1048576
+#define TSIZE 1048576 // initial number of hash table slots; tables grow as needed
 #define SEED 1159241
 #define ARRAY_SIZE_INCREMENT 2500
-#define HASHFN bitwisehash
 #define SEP_CHAR '\1'
 
 typedef double real;
@@ -43,18 +42,110 @@ typedef struct cooccur_rec {
     int word2;
     real val;
 } CREC;
-typedef struct hashrec {
-    char *word;
+/* Words stored back to back, null-terminated, in one growable block; referred to by 32-bit offsets */
+typedef struct string_arena {
+    char *data;
+    long long size; // bytes used
+    long long capacity; // bytes allocated
+} ARENA;
+typedef struct hashentry {
+    unsigned long long hash; // full hash of word, so probes and rehashing rarely touch the string; 0 marks an empty slot
+    unsigned int word; // offset of the word in the table's arena, see HASHWORD
     long long num; //count or id
-    struct hashrec *next;
-} HASHREC;
+} HASHENTRY;
+typedef struct hashtable {
+    HASHENTRY *slots; // open addressing with linear probing
+    long long size; // number of slots, a power of two
+    long long count; // number of words stored
+    ARENA words;
+} HASHTABLE;
 
+#define HASHWORD(ht, entry) ((ht)->words.data + (entry)->word)
+
+#define BVOCAB_MAGIC "GLOVEVB1"
+#define BVOCAB_DIRECT 0x80000000U // displacement flag: the bucket's single word is in the slot given by the other bits
+
+/* Binary vocabulary, mapped read-only; see bvocab_write for the layout. Ranks count from 1, as in cooccurrence records. */
+typedef struct binary_vocab {
+    char *data; // the mapping
+    long long bytes;
+    long long size; // number of words
+    long long num_buckets;
+    long long *counts; // counts[r - 1]: count of the word of rank r
+    long long *offsets; // pool + offsets[r - 1]: the word of rank r, null-terminated
+    unsigned int *displace; // per bucket displacement of the minimal perfect hash
+    unsigned int *slots; // rank - 1 of the word in each slot
+    char *pool;
+} BINVOCAB;
+
+#define BVOCAB_WORD(v, rank) ((v)->pool + (v)->offsets[(rank) - 1])
+
+
+/* Tokenizer over a corpus file or stream; see corpus_next_token for the tokenization rules */
+typedef struct corpus_reader {
+    char *data; // mmap of the whole file, or a read buffer when the input is a pipe
+    long long pos, end; // next byte to scan and end of valid data, as indices into data
+    long long offset; // file offset of data[0]
+    long long size; // size of the mapping or of the read buffer
+    int mapped; // 1: data is a mapping; 0: data is a read buffer filled from fin
+    int owner; // 1 if this reader releases data on close; 0 for views created by corpus_view
+    FILE *fin;
+    int eof; // stream fully read into the buffer
+    char word[MAX_STRING_LENGTH]; // scratch for tokens that cannot be returned in place
+} CORPUSREADER;
+
+/* Sequential reader of a file of cooccurrence records, refilled a block at a time */
+typedef struct crec_reader {
+    FILE *fid;
+    CREC *buf;
+    long long pos, end; // next record and end of valid records in buf
+    long long size; // records in buf
+    long long offset; // file offset just past the records in buf
+    long long remaining; // records left to read from the file, -1 to read to its end
+    long long (*fill)(void *source, CREC *out, long long n); // if not NULL, records come from fill(source, ...), not fid
+    void *source;
+} CRECREADER;
+
+/* K-way merge of sorted record sources with a tournament (loser) tree */
+typedef struct crec_merger {
+    int num; // number of sources
+    CRECREADER *sources;
+    CREC *heads; // current record of each source
+    int *live; // 0 once a source is exhausted
+    int *tree; // tree[0]: source of the smallest head; tree[1 .. num - 1]: loser at each internal node
+} CRECMERGER;
 
 int scmp( char *s1, char *s2 );
-unsigned int bitwisehash(char *word, int tsize, unsigned int seed);
-HASHREC **inithashtable();
-int get_word(char *word, FILE *fin);
-void free_table(HASHREC **ht);
+int sncmp( char *s1, char *s2, int len );
+int arena_init(ARENA *arena, long long capacity);
+long long arena_add(ARENA *arena, char *w, int len);
+void arena_free(ARENA *arena);
+unsigned long long wordhash(char *word, int len);
+HASHTABLE *hashtable_create(long long size);
+HASHENTRY *hashtable_search(HASHTABLE *ht, char *w, int len);
+HASHENTRY *hashtable_insert(HASHTABLE *ht, char *w, int len);
+void hashtable_clear(HASHTABLE *ht);
+void hashtable_free(HASHTABLE *ht);
+long long hashtable_num(void *ht, char *w, int len);
+int phrase_subtokens(char *w, int len, long long (*lookup)(void *, char *, int), void *vocab, int *ids);
+int bvocab_write(char *file_name, char **words, long long *counts, long long size);
+int bvocab_open(BINVOCAB *v, char *file_name);
+long long bvocab_search(BINVOCAB *v, char *w, int len);
+void bvocab_close(BINVOCAB *v);
+int corpus_open(CORPUSREADER *r, char *file_name);
+void corpus_view(CORPUSREADER *view, CORPUSREADER *r, long long start, long long end);
+long long corpus_split(CORPUSREADER *r, int num, long long *starts);
+int corpus_next_token(CORPUSREADER *r, char **word, int *len);
+long long corpus_offset(CORPUSREADER *r);
+void corpus_close(CORPUSREADER *r);
+int crec_reader_open(CRECREADER *r, char *file_name, long long size);
+int crec_reader_generate(CRECREADER *r, long long (*fill)(void *, CREC *, long long), void *source, long long count, long long size);
+int crec_reader_seek(CRECREADER *r, long long start, long long count);
+long long crec_reader_read(CRECREADER *r, CREC *out, long long n);
+void crec_reader_close(CRECREADER *r);
+int crec_merge_init(CRECMERGER *m, CRECREADER *sources, int num);
+int crec_merge_next(CRECMERGER *m, CREC *c);
+void crec_merge_free(CRECMERGER *m);
 int find_arg(char *str, int argc, char **argv);
 void free_fid(FILE **fid, const int num);
 
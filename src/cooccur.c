@@ -27,71 +27,304 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <time.h>
+#include <errno.h>
 #include "common.h"
 
-typedef struct cooccur_rec_id {
-    int word1;
-    int word2;
-    real val;
-    int id;
-} CRECID;
+#define IDS_MAGIC "GLOVEID1"
+#define IDS_NEWLINE -1
+#define IDS_BUFFER 1048576 // ints read or written at a time
+#define MERGE_BUFFER 65536 // most records read from each temporary file, or written to the output, at a time
+#define CHECKPOINT_MAGIC "GLOVECP1"
+#define CHECKPOINT_HEADER (9 + 4 * num_configs) // settings recorded in a checkpoint, see checkpoint_header
+#define UINT_WRAP 4294967296.0 // lost when an unsigned int count wraps around
+#define TABLE_BATCH 4096 // updates of the dense table buffered before they are applied
+#define PREFETCH_DISTANCE 16 // updates ahead of the one applied whose cell is prefetched
+
+/* Types of the counts in the dense table (-counter-bytes) */
+#define COUNTER_REAL 0
+#define COUNTER_FLOAT 1 // distance-weighted counts, to float precision
+#define COUNTER_UINT 2 // unweighted counts; exact, as every 2^32 that wraps around is sent to the overflow records
+
+/* Packed key of a record, ordered as by compare_crec */
+#define CREC_KEY(c) (((unsigned long long) (c).word1 << 32) | (unsigned int) (c).word2)
+
+/* Integer-encoded corpus (-ids-out, -ids-in): after a header of IDS_MAGIC, the vocabulary size and its fingerprint,
+   one int per token: its frequency rank, 0 if out of vocabulary, IDS_NEWLINE for a newline, or -(2 + n) for a phrase
+   out of vocabulary followed by the ranks of its n subtokens in the vocabulary */
+typedef struct id_stream {
+    FILE *fid;
+    int *buf;
+    long long pos, end;
+    long long remaining; // ints left to read, -1 to read to the end of the file
+    long long index; // of the next int read in the file, counting from the first after the header
+} IDSTREAM;
+
+/* A temporary file of sorted overflow records */
+typedef struct run_file {
+    int id; // file number
+    int level; // 0 if written by a counting thread, l + 1 if compacted from runs of level l
+    int key; // id of the oldest run of level 0 merged into it; the final merge takes runs in this order
+    int config; // the configuration whose records it holds
+} RUNFILE;
+
+/* Counts of the pairs in the band between the dense table and the overflow records, with open addressing. Once a
+   pair has a slot it keeps it, so each pair is counted either all here or all in overflow records. */
+typedef struct pair_table {
+    CREC *slots; // word1 is 0 in empty slots
+    long long size; // slots, a power of two
+    int shift; // 64 - log2(size)
+    long long count, max_count; // pairs stored; pairs without a slot go to the overflow once count reaches max_count
+} PAIRTABLE;
+
+/* Updates of the dense table, applied a batch at a time so that their cells can be prefetched */
+typedef struct table_batch {
+    CREC pairs[TABLE_BATCH]; // words and weight of each update
+    long long cells[TABLE_BATCH]; // and its cell
+    int num;
+} TABLEBATCH;
+
+/* The dense table, read by the merge in place of temporary file 0 */
+typedef struct dense_table {
+    void *cells; // bigram_table, or NULL if it was written to file 0
+    long long *lookup;
+    long long vocab_size;
+    long long *records; // records[x]: records (nonzero cells) in rows 1 .. x
+} DENSETABLE;
+
+/* A pass over the records of the dense table */
+typedef struct dense_cursor {
+    long long x; // row
+    long long a; // next cell to look at
+} DENSECURSOR;
+
+/* A token in the context window */
+typedef struct history_entry {
+    long long id; // frequency rank, 0 if out of vocabulary
+    int *subs; // frequency ranks of its subtokens in the vocabulary, if it is a phrase
+    int num_subs;
+    int oov_subs[MAX_STRING_LENGTH / 2 + 1]; // subs of a phrase out of vocabulary
+} HISTENTRY;
+
+/* A cooccurrence matrix counted in the pass over the corpus: one, or one per line of -configs. Its settings and the
+   sizes planned for it are loaded into the globals of the same names while it is planned and merged. */
+typedef struct cooccur_config {
+    int window_size, symmetric, distance_weighting, counter_type;
+    long long max_product, band_product, band_size, overflow_length, merge_memory;
+    long long *lookup; // row offsets of its dense tables, see CELL
+    char *output; // file the merged records go to, or the prefix of its range files with -output-ranges; NULL: stdout
+} COOCCONFIG;
+
+/* One thread's tables for one configuration */
+typedef struct cooccur_tables {
+    COOCCONFIG *config;
+    void *bigram_table; // dense counts, of config->counter_type, summed over threads at the end
+    CREC *cr; // overflow buffer, with TABLE_BATCH slots beyond overflow_length for the UINT_WRAP carries of batch_flush
+    CREC *buffer; // scratch for sorting cr, allocated when first needed
+    long long ind; // records in cr
+    long long threshold; // cr is written out once it holds this many records, so a token's records always fit
+    PAIRTABLE band; // counts of the pairs in the band
+    TABLEBATCH *batch;
+} COOCTABLES;
 
 int verbose = 2; // 0, 1, or 2
-long long max_product; // Cutoff for product of word frequency ranks below which cooccurrence counts will be stored in a compressed full array
-long long overflow_length; // Number of cooccurrence records whose product exceeds max_product to store in memory before writing to disk
+long long max_product = 0; // Cutoff for product of word frequency ranks below which cooccurrence counts will be stored in a compressed full array; 0: plan it
+long long overflow_length = 0; // Number of cooccurrence records whose product exceeds max_product to store in memory before writing to disk; 0: plan it
 int window_size = 15; // default context window size
 int symmetric = 1; // 0: asymmetric, 1: symmetric
-real memory_limit = 3; // soft limit, in gigabytes, used to estimate optimal array sizes
+real memory_limit = 3; // limit, in gigabytes, that plan_memory sizes the tables and buffers to
 int distance_weighting = 1; // Flag to control the distance weighting of cooccurrence counts
+int counter_type = COUNTER_REAL; // type of the counts in bigram_table
+int counter_bytes = sizeof(real);
+long long band_product = 0; // Cutoff for product of word frequency ranks below which pairs not in the dense table are counted in the band tables; 0: plan it
+long long band_size = -1; // slots in each thread's band table; 0: no band table; -1: plan it
+long long merge_memory; // bytes for the read buffers of the merge
+int dry_run = 0; // only print the plan
+real subsample = 0; // drop tokens of words with a share of the corpus f above it with probability 1 - (sqrt(f / subsample) + 1) * subsample / f; 0: keep all
+int dynamic_window = 0; // 1: shrink the window of each target word to a random span of 1 .. window_size, as word2vec does
+unsigned long long seed = 1; // of the random draws of subsample and dynamic_window
+real *keep_prob = NULL; // keep_prob[w]: probability of keeping a token of word w, if subsample > 0
 char *vocab_file, *file_head;
+char *phrase_file = NULL; // phrase index written by vocab_count; derived from the vocabulary if NULL
+char *ids_in_file = NULL; // read the corpus encoded by an earlier run with -ids-out from this file, instead of stdin
+char *ids_out_file = NULL; // write the corpus encoded as vocabulary ranks to this file
+char *corpus_file = NULL; // read the corpus from this file instead of stdin
+int num_threads = 1;
+int merge_threads = 0; // threads merging the temporary files, each over its own range of word1; 0: num_threads
+char *output_ranges = NULL; // write each range of the merge to its own file with this prefix, instead of all to stdout
+int fidcounter = 0; // number of the last temporary file of overflow records started; file 0 is the dense table
+pthread_mutex_t fidcounter_lock = PTHREAD_MUTEX_INITIALIZER; // guards fidcounter and the list of runs
+int compact_runs = 16; // merge this many runs of a level into one of the next level in the background; 0: never
+RUNFILE *runs = NULL; // temporary files of overflow records not yet merged into others
+int num_runs = 0, max_runs = 0;
+int runs_done = 0; // no more runs of level 0 will be written; the compaction thread exits once no level has compact_runs runs
+int compact_status = 0;
+pthread_cond_t runs_cond = PTHREAD_COND_INITIALIZER; // signalled when a run is added or runs_done is set
+real checkpoint_minutes = 0; // write a checkpoint of the counting this often; 0: never
+int resume = 0; // continue the counting from the checkpoint of an earlier run
+int checkpointing = 0; // while counting with checkpoints, temporary files merged into others are kept until one is written
+int checkpoint_due = 0; // the counting threads pause at the start of their next line for a checkpoint; accessed with __atomic builtins, as they poll it without the lock
+int checkpoint_paused = 0; // counting threads paused for the checkpoint, or done
+int counting_done = 0; // the checkpoint thread exits
+int compacting = 0; // the compaction thread is merging a group of runs
+pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER; // broadcast when any of the above changes
+int *retired = NULL; // temporary files merged into others, removed once a checkpoint no longer lists them
+int num_retired = 0, max_retired = 0;
+long long *phrase_start = NULL; // the subtokens of word w are phrase_subs[phrase_start[w]] .. phrase_subs[phrase_start[w + 1] - 1]
+int *phrase_subs = NULL;
+BINVOCAB bvocab; // mapped vocabulary, if vocab_file is binary
+DENSETABLE dense; // the dense table, while it takes part in a merge
+char *configs_file = NULL; // count the matrices listed in this file in one pass, instead of the one of the command line
+COOCCONFIG *configs = NULL;
+int num_configs = 1;
+int history_size; // tokens kept in the context window: the largest window_size of the configurations
+
+/* Insert string in hash table, check for string duplicates which should be absent */
+void hashinsert(HASHTABLE *ht, char *w, long long id) {
+    HASHENTRY *htmp = hashtable_insert(ht, w, strlen(w));
+    if (htmp == NULL) fprintf(stderr, "Couldn't allocate memory!");
+    else if (htmp->num != 0) fprintf(stderr, "Error, duplicate entry located: %s.\n",HASHWORD(ht, htmp));
+    else htmp->num = id;
+    return;
+}
 
-/* Search hash table for given string, return record if found, else NULL */
-HASHREC *hashsearch(HASHREC **ht, char *w) {
-    HASHREC     *htmp, *hprv;
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    for (hprv = NULL, htmp=ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    if ( htmp != NULL && hprv!=NULL ) { // move to front on access
-        hprv->next = htmp->next;
-        htmp->next = ht[hval];
-        ht[hval] = htmp;
+/* Make configuration c the one planned or merged: load its settings and sizes into the globals */
+void config_use(COOCCONFIG *c) {
+    window_size = c->window_size;
+    symmetric = c->symmetric;
+    distance_weighting = c->distance_weighting;
+    counter_type = c->counter_type;
+    max_product = c->max_product;
+    band_product = c->band_product;
+    band_size = c->band_size;
+    overflow_length = c->overflow_length;
+    merge_memory = c->merge_memory;
+}
+
+/* Keep the sizes planned for configuration c, from the globals */
+void config_store(COOCCONFIG *c) {
+    c->max_product = max_product;
+    c->band_product = band_product;
+    c->band_size = band_size;
+    c->overflow_length = overflow_length;
+    c->merge_memory = merge_memory;
+}
+
+/* Frequency rank of word w, 0 if it is out of vocabulary; a lookup for phrase_subtokens */
+long long vocab_rank(void *vocab_hash, char *w, int len) {
+    if (bvocab.data != NULL) return bvocab_search(&bvocab, w, len);
+    return hashtable_num(vocab_hash, w, len);
+}
+
+/* Index of the cell of words x, y (frequency ranks) in a dense table. Row x holds the words y with x * y about below
+   max_product; with symmetric context (sym > 0), only pairs with x <= y are stored, so row x starts at column x. */
+#define CELL(lookup, sym, x, y) ((lookup)[(x) - 1] + (y) - ((sym) > 0 ? (x) : 1) - 1)
+
+/* Add weight to cell index of a dense table of counts of type. Returns 1 if an unsigned count wrapped around, losing
+   UINT_WRAP. */
+int table_add(void *bigram_table, int type, long long index, real weight) {
+    if (type == COUNTER_UINT) return ++((unsigned int *) bigram_table)[index] == 0;
+    if (type == COUNTER_FLOAT) ((float *) bigram_table)[index] += weight;
+    else ((real *) bigram_table)[index] += weight;
+    return 0;
+}
+
+/* Count in cell index of a dense table */
+real table_get(void *bigram_table, long long index) {
+    if (counter_type == COUNTER_UINT) return ((unsigned int *) bigram_table)[index];
+    if (counter_type == COUNTER_FLOAT) return ((float *) bigram_table)[index];
+    return ((real *) bigram_table)[index];
+}
+
+/* Index of the first cell in [a, end) of a dense table that is not 0, or end. Cells are tested as bits, eight at a
+   time, so that the compiler can vectorize the runs of zeros; counts are never -0. */
+long long next_nonzero(void *bigram_table, long long a, long long end) {
+    unsigned long long *c8 = (unsigned long long *) bigram_table, any8;
+    unsigned int *c4 = (unsigned int *) bigram_table, any4;
+    int k;
+    if (counter_bytes == 4) {
+        for (; a + 8 <= end; a += 8) {
+            for (any4 = 0, k = 0; k < 8; k++) any4 |= c4[a + k];
+            if (any4) break;
+        }
+        for (; a < end && c4[a] == 0; a++);
     }
-    return(htmp);
+    else {
+        for (; a + 8 <= end; a += 8) {
+            for (any8 = 0, k = 0; k < 8; k++) any8 |= c8[a + k];
+            if (any8) break;
+        }
+        for (; a < end && c8[a] == 0; a++);
+    }
+    return a;
 }
 
-/* Insert string in hash table, check for string duplicates which should be absent */
-void hashinsert(HASHREC **ht, char *w, long long id) {
-    HASHREC     *htmp, *hprv;
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    for (hprv = NULL, htmp = ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    if (htmp == NULL) {
-        htmp = (HASHREC *) malloc(sizeof(HASHREC));
-        htmp->word = (char *) malloc(strlen(w) + 1);
-        strcpy(htmp->word, w);
-        htmp->num = id;
-        htmp->next = NULL;
-        if (hprv == NULL) ht[hval] = htmp;
-        else hprv->next = htmp;
-    }
-    else fprintf(stderr, "Error, duplicate entry located: %s.\n",htmp->word);
-    return;
+/* Count the records of the dense table, the cells that are not 0, row by row. Returns 1 on failure, 0 otherwise. */
+int dense_open(void *bigram_table, long long *lookup, long long vocab_size) {
+    long long x, a;
+    dense.cells = bigram_table;
+    dense.lookup = lookup;
+    dense.vocab_size = vocab_size;
+    if ((dense.records = (long long *) malloc(sizeof(long long) * (vocab_size + 1))) == NULL) return 1;
+    dense.records[0] = 0;
+    for (x = 1; x <= vocab_size; x++) {
+        dense.records[x] = dense.records[x - 1];
+        for (a = lookup[x - 1] - 1; (a = next_nonzero(bigram_table, a, lookup[x] - 1)) < lookup[x] - 1; a++) dense.records[x]++;
+    }
+    return 0;
+}
+
+void dense_close() {
+    free(dense.cells);
+    free(dense.lookup);
+    free(dense.records);
+    dense.cells = NULL;
+}
+
+/* Row of record index of the dense table */
+int dense_word1(long long index) {
+    long long lo = 1, hi = dense.vocab_size, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (dense.records[mid] > index) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+/* Next records of the dense table, for a CRECREADER; see crec_reader_generate */
+long long dense_fill(void *source, CREC *out, long long n) {
+    DENSECURSOR *c = (DENSECURSOR *) source;
+    long long k = 0, end;
+    for (; k < n && c->x <= dense.vocab_size; c->x++) {
+        end = dense.lookup[c->x] - 1;
+        while (k < n && (c->a = next_nonzero(dense.cells, c->a, end)) < end) {
+            out[k].word1 = c->x;
+            out[k].word2 = c->a - dense.lookup[c->x - 1] + 1 + (symmetric > 0 ? c->x : 1); // inverse of CELL
+            out[k++].val = table_get(dense.cells, c->a++);
+        }
+        if (c->a < end) break; // out is full in the middle of the row
+    }
+    return k;
 }
 
-/* Write sorted chunk of cooccurrence records to file, accumulating duplicate entries */
+/* Write sorted chunk of cooccurrence records to file, accumulating duplicate entries in place first */
 int write_chunk(CREC *cr, long long length, FILE *fout) {
     if (length == 0) return 0;
 
-    long long a = 0;
-    CREC old = cr[a];
-    
-    for (a = 1; a < length; a++) {
-        if (cr[a].word1 == old.word1 && cr[a].word2 == old.word2) {
-            old.val += cr[a].val;
-            continue;
-        }
-        fwrite(&old, sizeof(CREC), 1, fout);
-        old = cr[a];
+    long long a, b;
+    for (a = 0, b = 1; b < length; b++) {
+        if (cr[b].word1 == cr[a].word1 && cr[b].word2 == cr[a].word2) cr[a].val += cr[b].val;
+        else cr[++a] = cr[b];
     }
-    fwrite(&old, sizeof(CREC), 1, fout);
+    fwrite(cr, sizeof(CREC), a + 1, fout);
     return 0;
 }
 
@@ -102,354 +335,1869 @@ int compare_crec(const void *a, const void *b) {
     else return (((CREC *) a)->word2 - ((CREC *) b)->word2);
 }
 
-/* Check if two cooccurrence records are for the same two words */
-int compare_crecid(CRECID a, CRECID b) {
-    int c;
-    if ( (c = a.word1 - b.word1) != 0) return c;
-    else return a.word2 - b.word2;
+/* One range of word1 of the merge of the temporary files */
+typedef struct merge_task {
+    int num; // number of temporary files
+    int *ids; // their file numbers
+    long long *starts, *ends; // records starts[i] .. ends[i] - 1 of file i are in the range
+    long long buffer; // records to buffer from each file
+    FILE *fout; // output
+    long long count; // records written, after accumulating duplicates
+    int progress; // report progress on stderr
+    int status;
+} MERGETASK;
+
+/* Write length merged records to the task's output */
+int merge_flush(MERGETASK *t, CREC *out, long long length) {
+    return fwrite(out, sizeof(CREC), length, t->fout) != (size_t) length;
 }
 
-/* Swap two entries of priority queue */
-void swap_entry(CRECID *pq, int i, int j) {
-    CRECID temp = pq[i];
-    pq[i] = pq[j];
-    pq[j] = temp;
+/* Merge the task's range of the temporary files, accumulating duplicates */
+void *merge_range(void *arg) {
+    MERGETASK *t = (MERGETASK *) arg;
+    int i, num = 0;
+    long long size = 0;
+    char filename[200];
+    CRECREADER *sources = (CRECREADER *) malloc(sizeof(CRECREADER) * (t->num + 1));
+    CRECMERGER merger;
+    DENSECURSOR cursor;
+    CREC new, *out = (CREC *) malloc(sizeof(CREC) * MERGE_BUFFER);
+    t->count = 0;
+    t->status = 1;
+    if (sources == NULL || out == NULL) {free(sources); free(out); return NULL;}
+    
+    /* Open the files with records in the range and start the merge */
+    for (i = 0; i < t->num; i++) {
+        if (t->ends[i] == t->starts[i]) continue;
+        if (t->ids[i] == 0 && dense.cells != NULL) {
+            // Ranges of the merge are of whole rows, so the range starts at the start of a row
+            cursor.x = dense_word1(t->starts[i]);
+            cursor.a = dense.lookup[cursor.x - 1] - 1;
+            if (crec_reader_generate(&sources[num++], dense_fill, &cursor, t->ends[i] - t->starts[i], t->buffer) != 0) break;
+            continue;
+        }
+        sprintf(filename,"%s_%04d.bin",file_head,t->ids[i]);
+        if (crec_reader_open(&sources[num], filename, t->buffer) != 0) {
+            log_file_loading_error("file", filename);
+            break;
+        }
+        num++;
+        if (crec_reader_seek(&sources[num - 1], t->starts[i], t->ends[i] - t->starts[i]) != 0) break;
+    }
+    if (i < t->num || crec_merge_init(&merger, sources, num) != 0) {
+        while (--num >= 0) crec_reader_close(&sources[num]);
+        free(sources);
+        free(out);
+        return NULL;
+    }
+    
+    /* Accumulate duplicates into the last record of the output buffer, writing the buffer whenever it fills */
+    t->status = 0;
+    while (crec_merge_next(&merger, &new)) {
+        if (size > 0 && new.word1 == out[size - 1].word1 && new.word2 == out[size - 1].word2) {
+            out[size - 1].val += new.val;
+            continue;
+        }
+        if (size == MERGE_BUFFER) {
+            if ((t->status = merge_flush(t, out, size - 1)) != 0) break;
+            out[0] = out[size - 1];
+            size = 1;
+        }
+        out[size++] = new;
+        if ((++t->count%100000) == 0) if (t->progress && verbose > 1) fprintf(stderr,"\033[39G%lld lines.",t->count);
+    }
+    if (t->status == 0) t->status = merge_flush(t, out, size);
+    for (i = 0; i < num; i++) crec_reader_close(&sources[i]);
+    crec_merge_free(&merger);
+    free(sources);
+    free(out);
+    return NULL;
+}
+
+/* Word1 of record index of a temporary file, or of the dense table if fid is NULL */
+int record_word1(FILE *fid, long long index) {
+    CREC c;
+    if (fid == NULL) return dense_word1(index);
+    if (fseeko(fid, index * (long long) sizeof(CREC), SEEK_SET) != 0 || fread(&c, sizeof(CREC), 1, fid) != 1) return 0;
+    return c.word1;
 }
 
-/* Insert entry into priority queue */
-void insert(CRECID *pq, CRECID new, int size) {
-    int j = size - 1, p;
-    pq[j] = new;
-    while ( (p=(j-1)/2) >= 0 ) {
-        if (compare_crecid(pq[p],pq[j]) > 0) {swap_entry(pq,p,j); j = p;}
-        else break;
+/* Index of the first of the length records of a sorted temporary file, or of the dense table if fid is NULL, with
+   word1 >= w */
+long long record_search(FILE *fid, long long length, int w) {
+    long long lo = 0, hi = length, mid;
+    if (fid == NULL) return w <= 1 ? 0 : w > dense.vocab_size ? length : dense.records[w - 1];
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (record_word1(fid, mid) < w) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
 }
 
-/* Delete entry from priority queue */
-void delete(CRECID *pq, int size) {
-    int j, p = 0;
-    pq[p] = pq[size - 1];
-    while ( (j = 2*p+1) < size - 1 ) {
-        if (j == size - 2) {
-            if (compare_crecid(pq[p],pq[j]) > 0) swap_entry(pq,p,j);
-            return;
-        }
-        else {
-            if (compare_crecid(pq[j], pq[j+1]) < 0) {
-                if (compare_crecid(pq[p],pq[j]) > 0) {swap_entry(pq,p,j); p = j;}
-                else return;
-            }
-            else {
-                if (compare_crecid(pq[p],pq[j+1]) > 0) {swap_entry(pq,p,j+1); p = j + 1;}
-                else return;
-            }
+typedef struct range_sample {
+    int word1;
+    real weight; // records the sample stands for
+} RANGESAMPLE;
+
+int compare_sample(const void *a, const void *b) {
+    return ((RANGESAMPLE *) a)->word1 - ((RANGESAMPLE *) b)->word1;
+}
+
+/* Choose bounds[1 .. num_ranges - 1], the first word1 of each range but the first, so that the ranges hold about the
+   same number of records: sample word1 in each file, about 64 times per range over all files, and take quantiles */
+void range_bounds(FILE **fid, long long *records, int num, long long total, int num_ranges, int *bounds) {
+    int i, r;
+    long long j, k, num_samples = 0;
+    real sum = 0;
+    RANGESAMPLE *samples = (RANGESAMPLE *) malloc(sizeof(RANGESAMPLE) * (64 * (long long) num_ranges + num));
+    for (i = 0; i < num; i++) {
+        if (records[i] == 0) continue;
+        k = 1 + records[i] * 64 * num_ranges / total;
+        if (k > records[i]) k = records[i];
+        for (j = 0; j < k; j++) {
+            samples[num_samples].word1 = record_word1(fid[i], records[i] * j / k);
+            samples[num_samples++].weight = (real) records[i] / k;
         }
     }
+    qsort(samples, num_samples, sizeof(RANGESAMPLE), compare_sample);
+    for (r = 1, j = 0; r < num_ranges; r++) {
+        while (j < num_samples && sum + samples[j].weight <= (real) total * r / num_ranges) sum += samples[j++].weight;
+        bounds[r] = j < num_samples ? samples[j].word1 : samples[num_samples - 1].word1 + 1;
+        if (bounds[r] < bounds[r - 1]) bounds[r] = bounds[r - 1];
+    }
+    free(samples);
 }
 
-/* Write top node of priority queue to file, accumulating duplicate entries */
-int merge_write(CRECID new, CRECID *old, FILE *fout) {
-    if (new.word1 == old->word1 && new.word2 == old->word2) {
-        old->val += new.val;
-        return 0; // Indicates duplicate entry
+/* Append the file filename to out: with sendfile where the kernel supports it, else through a buffer.
+   Returns 1 on failure, 0 otherwise. */
+int append_file(char *filename, FILE *out) {
+    int in, fd = fileno(out), status = 0;
+    long long k = -1, done, written;
+    char *buf;
+    if (fflush(out) != 0 || (in = open(filename, O_RDONLY)) < 0) return 1;
+#ifdef __linux__
+    while ((k = sendfile(fd, in, NULL, 1 << 30)) > 0);
+#endif
+    if (k < 0) {
+        // Go on from where sendfile stopped, if it failed, with plain reads and writes
+        if ((buf = (char *) malloc(sizeof(CREC) * MERGE_BUFFER)) == NULL) status = 1;
+        while (status == 0 && (k = read(in, buf, sizeof(CREC) * MERGE_BUFFER)) > 0) {
+            for (done = 0; done < k; done += written) {
+                if ((written = write(fd, buf + done, k - done)) <= 0) {status = 1; break;}
+            }
+        }
+        if (k < 0) status = 1;
+        free(buf);
     }
-    fwrite(old, sizeof(CREC), 1, fout);
-    *old = new;
-    return 1; // Actually wrote to file
+    close(in);
+    return status;
 }
 
-/* Merge [num] sorted files of cooccurrence records */
-int merge_files(int num) {
-    int i, size;
-    long long counter = 0;
-    CRECID *pq, new, old;
-    char filename[200];
-    FILE **fid, *fout;
-    fid = calloc(num, sizeof(FILE));
-    pq = malloc(sizeof(CRECID) * num);
-    fout = stdout;
-    if (verbose > 1) fprintf(stderr, "Merging cooccurrence files: processed 0 lines.");
+/* Merge the [num] sorted files of cooccurrence records numbered ids, in that order, into out. With more than one merge
+   thread, each thread merges the records in its own range of word1, found by binary search in each file, so that no
+   duplicates cross ranges. The ranges are written to files with the prefix ranges if it is not NULL, or else to
+   temporary range files appended to out in order. */
+int merge_files(int *ids, int num, FILE *out, char *ranges) {
+    int i, r, status = 0, threads = merge_threads > 0 ? merge_threads : num_threads, *bounds;
+    long long total = 0, *records, buffer;
+    char filename[MAX_STRING_LENGTH + 20];
+    FILE **fid;
+    MERGETASK *tasks;
+    pthread_t *pt;
     
-    /* Open all files and add first entry of each to priority queue */
+    fid = (FILE **) calloc(num, sizeof(FILE *));
+    records = (long long *) calloc(num, sizeof(long long));
     for (i = 0; i < num; i++) {
-        sprintf(filename,"%s_%04d.bin",file_head,i);
-        fid[i] = fopen(filename,"rb");
-        if (fid[i] == NULL) {log_file_loading_error("file", filename); free_fid(fid, num); free(pq); return 1;}
-        fread(&new, sizeof(CREC), 1, fid[i]);
-        new.id = i;
-        insert(pq,new,i+1);
+        if (ids[i] == 0 && dense.cells != NULL) {
+            records[i] = dense.records[dense.vocab_size];
+            total += records[i];
+            continue;
+        }
+        sprintf(filename,"%s_%04d.bin",file_head,ids[i]);
+        if ((fid[i] = fopen(filename, "rb")) == NULL) {
+            log_file_loading_error("file", filename);
+            free_fid(fid, num);
+            free(records);
+            return 1;
+        }
+        if (fseeko(fid[i], 0, SEEK_END) == 0) records[i] = ftello(fid[i]) / sizeof(CREC);
+        total += records[i];
+    }
+    if (total == 0) {
+        free_fid(fid, num);
+        free(records);
+        for (i=0;i<num;i++) {
+            sprintf(filename,"%s_%04d.bin",file_head,ids[i]);
+            remove(filename);
+        }
+        return 0;
     }
     
-    /* Pop top node, save it in old to see if the next entry is a duplicate */
-    size = num;
-    old = pq[0];
-    i = pq[0].id;
-    delete(pq, size);
-    fread(&new, sizeof(CREC), 1, fid[i]);
-    if (feof(fid[i])) size--;
-    else {
-        new.id = i;
-        insert(pq, new, size);
+    /* Each thread reads all files at once, so stay within the limit on open files */
+    if (threads > 1 && num * (long long) threads + 16 > sysconf(_SC_OPEN_MAX)) threads = (sysconf(_SC_OPEN_MAX) - 16) / num;
+    if (threads < 1) threads = 1;
+    /* Share the memory planned for the merge between the read buffers */
+    buffer = merge_memory / (long long) sizeof(CREC) / threads / num;
+    if (buffer > MERGE_BUFFER) buffer = MERGE_BUFFER;
+    if (buffer < 4096) buffer = 4096;
+    
+    tasks = (MERGETASK *) calloc(threads, sizeof(MERGETASK));
+    bounds = (int *) malloc(sizeof(int) * (threads + 1));
+    pt = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+    bounds[0] = 0;
+    range_bounds(fid, records, num, total, threads, bounds);
+    for (r = 0; r < threads; r++) {
+        tasks[r].num = num;
+        tasks[r].ids = ids;
+        tasks[r].starts = (long long *) malloc(sizeof(long long) * num);
+        tasks[r].ends = (long long *) malloc(sizeof(long long) * num);
+        tasks[r].buffer = buffer;
+        tasks[r].progress = threads == 1;
+        for (i = 0; i < num; i++) {
+            tasks[r].starts[i] = r == 0 ? 0 : tasks[r - 1].ends[i];
+            tasks[r].ends[i] = r == threads - 1 ? records[i] : record_search(fid[i], records[i], bounds[r + 1]);
+        }
     }
+    free_fid(fid, num);
     
-    /* Repeatedly pop top node and fill priority queue until files have reached EOF */
-    while (size > 0) {
-        counter += merge_write(pq[0], &old, fout); // Only count the lines written to file, not duplicates
-        if ((counter%100000) == 0) if (verbose > 1) fprintf(stderr,"\033[39G%lld lines.",counter);
-        i = pq[0].id;
-        delete(pq, size);
-        fread(&new, sizeof(CREC), 1, fid[i]);
-        if (feof(fid[i])) size--;
+    if (verbose > 1) fprintf(stderr, "Merging cooccurrence files: processed 0 lines.");
+    if (ranges == NULL && threads == 1) tasks[0].fout = out;
+    else {
+        for (r = 0; r < threads && status == 0; r++) {
+            if (ranges != NULL) sprintf(filename, "%s_%04d.bin", ranges, r);
+            else sprintf(filename, "%s_range_%04d.bin", file_head, r);
+            if ((tasks[r].fout = fopen(filename, "wb")) == NULL) status = log_file_loading_error("range file", filename);
+        }
+    }
+    if (status == 0) {
+        if (threads == 1) merge_range((void *)&tasks[0]);
         else {
-            new.id = i;
-            insert(pq, new, size);
+            for (r = 0; r < threads; r++) pthread_create(&pt[r], NULL, merge_range, (void *)&tasks[r]);
+            for (r = 0; r < threads; r++) pthread_join(pt[r], NULL);
+        }
+    }
+    
+    for (r = 0, total = 0; r < threads; r++) {
+        status |= tasks[r].status;
+        total += tasks[r].count;
+        if (tasks[r].fout != NULL && tasks[r].fout != out && fclose(tasks[r].fout) != 0) status = 1;
+        free(tasks[r].starts);
+        free(tasks[r].ends);
+    }
+    if (ranges == NULL && threads > 1) {
+        // Each range was merged once into its own file; out gets them in order
+        for (r = 0; r < threads; r++) {
+            sprintf(filename, "%s_range_%04d.bin", file_head, r);
+            if (status == 0 && append_file(filename, out) != 0) {
+                fprintf(stderr, "Couldn't append range file %s to the output.\n", filename);
+                status = 1;
+            }
+            remove(filename);
         }
     }
-    fwrite(&old, sizeof(CREC), 1, fout);
-    fprintf(stderr,"\033[0GMerging cooccurrence files: processed %lld lines.\n",++counter);
-    for (i=0;i<num;i++) {
-        sprintf(filename,"%s_%04d.bin",file_head,i);
+    fprintf(stderr,"\033[0GMerging cooccurrence files: processed %lld lines.\n",total);
+    for (r = 0; r < num; r++) {
+        sprintf(filename,"%s_%04d.bin",file_head,ids[r]);
         remove(filename);
     }
     fprintf(stderr,"\n");
-    free_fid(fid, num);
-    free(pq);
+    free(tasks);
+    free(bounds);
+    free(pt);
+    free(records);
+    return status;
+}
+
+/* Add a run of configuration config to the list; fidcounter_lock must be held */
+int add_run(int id, int level, int key, int config) {
+    RUNFILE *tmp;
+    if (num_runs == max_runs) {
+        max_runs = max_runs == 0 ? 64 : 2 * max_runs;
+        if ((tmp = (RUNFILE *) realloc(runs, sizeof(RUNFILE) * max_runs)) == NULL) return 1;
+        runs = tmp;
+    }
+    runs[num_runs].id = id;
+    runs[num_runs].level = level;
+    runs[num_runs].config = config;
+    runs[num_runs++].key = key;
+    pthread_cond_signal(&runs_cond);
     return 0;
 }
 
-void free_resources(HASHREC** vocab_hash, CREC *cr, long long *lookup, real *bigram_table) {
-    free_table(vocab_hash);
-    free(cr);
-    free(lookup);
-    free(bigram_table);
+int compare_run(const void *a, const void *b) {
+    return ((RUNFILE *) a)->key - ((RUNFILE *) b)->key;
+}
+
+/* Take the compact_runs oldest runs of the lowest level of a configuration that has that many out of the list, into
+   group; fidcounter_lock must be held. Returns 0 if no level has enough runs, 1 otherwise. */
+int take_runs(RUNFILE *group) {
+    int a, b, n, lowest = -1, config = 0;
+    for (a = 0; a < num_runs; a++) {
+        for (b = 0, n = 0; b < num_runs; b++) n += runs[b].level == runs[a].level && runs[b].config == runs[a].config;
+        if (n >= compact_runs && (lowest < 0 || runs[a].level < lowest)) {
+            lowest = runs[a].level;
+            config = runs[a].config;
+        }
+    }
+    if (lowest < 0) return 0;
+    qsort(runs, num_runs, sizeof(RUNFILE), compare_run);
+    for (a = 0, b = 0, n = 0; a < num_runs; a++) {
+        if (runs[a].level == lowest && runs[a].config == config && n < compact_runs) group[n++] = runs[a];
+        else runs[b++] = runs[a];
+    }
+    num_runs = b;
+    return 1;
+}
+
+/* Merge the group of compact_runs runs into the new run id; see retire_run for their removal. task has room for
+   compact_runs files. Returns 1 on failure, 0 otherwise. */
+int compact_group(RUNFILE *group, int id, MERGETASK *task) {
+    int i;
+    char filename[MAX_STRING_LENGTH + 20];
+    FILE *fid;
+    for (i = 0; i < compact_runs; i++) {
+        task->ids[i] = group[i].id;
+        task->starts[i] = task->ends[i] = 0;
+        sprintf(filename,"%s_%04d.bin",file_head,group[i].id);
+        if ((fid = fopen(filename, "rb")) == NULL) return log_file_loading_error("temp file", filename);
+        if (fseeko(fid, 0, SEEK_END) == 0) task->ends[i] = ftello(fid) / sizeof(CREC);
+        fclose(fid);
+    }
+    sprintf(filename,"%s_%04d.bin",file_head,id);
+    if ((task->fout = fopen(filename, "wb")) == NULL) return log_file_loading_error("temp file", filename);
+    merge_range((void *)task);
+    fclose(task->fout);
+    if (task->status != 0) return 1;
+    if (verbose > 2) fprintf(stderr, "\nCompacted %d runs of level %d into %s_%04d.bin, %lld records.\n", compact_runs, group[0].level, file_head, id, task->count);
+    return 0;
+}
+
+/* Remove temporary file id, merged into another; while checkpointing, keep it until the next checkpoint, which no
+   longer lists it. fidcounter_lock must be held. Returns 1 on failure, 0 otherwise. */
+int retire_run(int id) {
+    char filename[MAX_STRING_LENGTH + 20];
+    int *tmp;
+    if (!checkpointing) {
+        sprintf(filename,"%s_%04d.bin",file_head,id);
+        remove(filename);
+        return 0;
+    }
+    if (num_retired == max_retired) {
+        max_retired = max_retired == 0 ? 64 : 2 * max_retired;
+        if ((tmp = (int *) realloc(retired, sizeof(int) * max_retired)) == NULL) return 1;
+        retired = tmp;
+    }
+    retired[num_retired++] = id;
+    return 0;
 }
 
-void count_occour(long long target_freq_rank, long long context_freq_rank, real cntxt_weight, long long *lookup, CREC *cr, long long *ind, real *bigram_table) {
+/* Remove the retired temporary files; fidcounter_lock must be held, unless no other thread is running */
+void remove_retired() {
+    char filename[MAX_STRING_LENGTH + 20];
+    int a;
+    for (a = 0; a < num_retired; a++) {
+        sprintf(filename,"%s_%04d.bin",file_head,retired[a]);
+        remove(filename);
+    }
+    num_retired = 0;
+}
+
+/* Compact runs in the background while counting, so that neither the number of temporary files nor the space
+   taken by duplicates in them grows without bound: whenever a level has compact_runs runs, merge the oldest of them
+   into one of the next level. The runs merged and their order depend only on the order runs were written in. */
+void *compact_thread(void *arg) {
+    int i, id;
+    RUNFILE *group = (RUNFILE *) malloc(sizeof(RUNFILE) * compact_runs);
+    MERGETASK task;
+    (void) arg;
+    memset(&task, 0, sizeof(MERGETASK));
+    task.num = compact_runs;
+    task.ids = (int *) malloc(sizeof(int) * compact_runs);
+    task.starts = (long long *) malloc(sizeof(long long) * compact_runs);
+    task.ends = (long long *) malloc(sizeof(long long) * compact_runs);
+    task.buffer = MERGE_BUFFER;
+    if (group == NULL || task.ids == NULL || task.starts == NULL || task.ends == NULL) compact_status = 1;
+    pthread_mutex_lock(&fidcounter_lock);
+    while (compact_status == 0) {
+        // No new group is started while a checkpoint waits
+        if (__atomic_load_n(&checkpoint_due, __ATOMIC_ACQUIRE) || !take_runs(group)) {
+            if (runs_done) break;
+            pthread_cond_wait(&runs_cond, &fidcounter_lock);
+            continue;
+        }
+        id = ++fidcounter;
+        compacting = 1;
+        pthread_mutex_unlock(&fidcounter_lock);
+        compact_status = compact_group(group, id, &task);
+        pthread_mutex_lock(&fidcounter_lock);
+        if (compact_status == 0) compact_status = add_run(id, group[0].level + 1, group[0].key, group[0].config);
+        for (i = 0; i < compact_runs && compact_status == 0; i++) compact_status = retire_run(group[i].id);
+        compacting = 0;
+        pthread_cond_broadcast(&checkpoint_cond);
+    }
+    pthread_mutex_unlock(&fidcounter_lock);
+    free(group);
+    free(task.ids);
+    free(task.starts);
+    free(task.ends);
+    return NULL;
+}
+
+/* Start compacting runs in the background, if compact_runs asks for it */
+void compact_start(pthread_t *compactor) {
+    runs_done = 0;
+    if (compact_runs > 1) pthread_create(compactor, NULL, compact_thread, NULL);
+}
+
+/* Let the compaction thread finish the levels with compact_runs runs left and wait for it. Returns its status. */
+int compact_finish(pthread_t compactor) {
+    if (compact_runs <= 1) return 0;
+    pthread_mutex_lock(&fidcounter_lock);
+    runs_done = 1;
+    pthread_cond_signal(&runs_cond);
+    pthread_mutex_unlock(&fidcounter_lock);
+    pthread_join(compactor, NULL);
+    return compact_status;
+}
+
+/* Merge file first and the runs of configuration config in the list after it, in the order they were written, into
+   out (see merge_files), taking them out of the list */
+int merge_runs(int first, int config, FILE *out, char *ranges) {
+    int a, b, n, status, *ids = (int *) malloc(sizeof(int) * (num_runs + 1));
+    if (ids == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    qsort(runs, num_runs, sizeof(RUNFILE), compare_run);
+    ids[0] = first;
+    for (a = 0, b = 0, n = 1; a < num_runs; a++) {
+        if (runs[a].config == config) ids[n++] = runs[a].id;
+        else runs[b++] = runs[a];
+    }
+    num_runs = b;
+    status = merge_files(ids, n, out, ranges);
+    free(ids);
+    return status;
+}
+
+void free_resources(HASHTABLE *vocab_hash) {
+    hashtable_free(vocab_hash);
+    free(phrase_start);
+    free(phrase_subs);
+    free(keep_prob);
+    bvocab_close(&bvocab);
+}
+
+/* Start fetching cell index of a dense table into the cache */
+void table_prefetch(void *bigram_table, long long index) {
+#ifdef __GNUC__
+    __builtin_prefetch((char *) bigram_table + index * counter_bytes, 1);
+#else
+    (void) bigram_table; (void) index;
+#endif
+}
+
+/* Append a record to the overflow buffer */
+void add_record(CREC *cr, long long *ind, long long word1, long long word2, real val) {
+    cr[*ind].word1 = word1;
+    cr[*ind].word2 = word2;
+    cr[*ind].val = val;
+    *ind = *ind + 1;
+}
+
+/* Add weight to pair w1, w2 in a band table. Returns 1 if the pair has no slot and the table is full, 0 otherwise. */
+int band_add(PAIRTABLE *band, long long w1, long long w2, real weight) {
+    unsigned long long key = ((unsigned long long) w1 << 32) | (unsigned int) w2;
+    long long a = (key * 0x9E3779B97F4A7C15ULL) >> band->shift;
+    CREC *slot;
+    for (;; a = (a + 1) & (band->size - 1)) {
+        slot = &band->slots[a];
+        if (slot->word1 == w1 && slot->word2 == w2) break;
+        if (slot->word1 == 0) {
+            if (band->count == band->max_count) return 1;
+            band->count++;
+            slot->word1 = w1;
+            slot->word2 = w2;
+            break;
+        }
+    }
+    slot->val += weight;
+    return 0;
+}
+
+/* Apply the updates of the batch of t to its dense table in the order they were made, so the sums are as if each was
+   applied at once, while prefetching the cells of those a few places ahead: each update is likely a cache miss on its
+   own */
+void batch_flush(COOCTABLES *t) {
+    TABLEBATCH *batch = t->batch;
+    int a;
+    for (a = 0; a < batch->num && a < PREFETCH_DISTANCE; a++) table_prefetch(t->bigram_table, batch->cells[a]);
+    for (a = 0; a < batch->num; a++) {
+        if (a + PREFETCH_DISTANCE < batch->num) table_prefetch(t->bigram_table, batch->cells[a + PREFETCH_DISTANCE]);
+        if (table_add(t->bigram_table, t->config->counter_type, batch->cells[a], batch->pairs[a].val)) add_record(t->cr, &t->ind, batch->pairs[a].word1, batch->pairs[a].word2, UINT_WRAP);
+    }
+    batch->num = 0;
+}
+
+/* Buffer an update of cell (w1, w2) of the dense table of t, applying the batch first if it is full */
+void batch_add(COOCTABLES *t, long long w1, long long w2, real weight) {
+    TABLEBATCH *batch = t->batch;
+    if (batch->num == TABLE_BATCH) batch_flush(t);
+    batch->pairs[batch->num].word1 = w1;
+    batch->pairs[batch->num].word2 = w2;
+    batch->pairs[batch->num].val = weight;
+    batch->cells[batch->num++] = CELL(t->config->lookup, t->config->symmetric, w1, w2);
+}
+
+void count_occour(COOCTABLES *t, long long target_freq_rank, long long context_freq_rank, real cntxt_weight) {
+    COOCCONFIG *c = t->config;
+    long long w1 = context_freq_rank, w2 = target_freq_rank;
     if (verbose > 2) fprintf(stderr, "Adding cooccur between words %lld and %lld.\n", context_freq_rank, target_freq_rank);
 
-    if ( context_freq_rank < max_product / target_freq_rank ) { 
+    // If symmetric context is used, (w1, w2) also stands for (w2, w1) (ie the right context too), so count only the
+    // pair with w1 <= w2; mirror_runs adds the other half to the output. A word cooccurring with itself counts twice.
+    if (c->symmetric > 0 && w1 > w2) {
+        w1 = target_freq_rank;
+        w2 = context_freq_rank;
+    }
+    if ( context_freq_rank < c->max_product / target_freq_rank ) { 
         // Product is small enough to store in a full array
         // Weight by inverse of distance between words if needed
-        bigram_table[lookup[context_freq_rank - 1] + target_freq_rank - 2] += cntxt_weight; 
-        if (symmetric > 0){
-            // If symmetric context is used, exchange roles of w2 and w1 (ie look at right context too)
-            bigram_table[lookup[target_freq_rank - 1] + context_freq_rank - 2] += cntxt_weight; 
-        }
+        batch_add(t, w1, w2, cntxt_weight);
+        if (c->symmetric > 0 && w1 == w2) batch_add(t, w1, w2, cntxt_weight);
+    }
+    else if (t->band.size > 0 && w1 < c->band_product / w2 && band_add(&t->band, w1, w2, cntxt_weight) == 0) {
+        // Product is in the band above: too sparse for a full array, but the pairs recur often enough to keep in a hash table
+        if (c->symmetric > 0 && w1 == w2) band_add(&t->band, w1, w2, cntxt_weight);
     }
     else { 
         // Entries in which the frequency product is too big are likely to be sparse
         // These are probably two not-so-frequent words occouring together; it isnt efficient to keep this in bigram table given sparseness
         // Store these entries in a temporary buffer to be sorted, merged (accumulated), and written to file when it gets full.
-        cr[*ind].word1 = context_freq_rank;
-        cr[*ind].word2 = target_freq_rank;
-        cr[*ind].val = cntxt_weight;
-        *ind = *ind + 1; // Keep track of how full temporary buffer is
-        if (symmetric > 0) { // Symmetric context, adds both ways
-            cr[*ind].word1 = target_freq_rank;
-            cr[*ind].word2 = context_freq_rank;
-            cr[*ind].val = cntxt_weight;
-            *ind = *ind + 1;
-        }
+        add_record(t->cr, &t->ind, w1, w2, cntxt_weight); // ind keeps track of how full temporary buffer is
+        if (c->symmetric > 0 && w1 == w2) add_record(t->cr, &t->ind, w1, w2, cntxt_weight);
     }
 }
 
-void count_context(char *str, char *sub_str, int j, char history[][MAX_STRING_LENGTH + 1], long long *lookup, CREC *cr, long long *ind, real *bigram_table, HASHREC** vocab_hash) {
-    long long w1, w2, k, l, i;
+/* Random draw number draw in [0, 1) for the token at position (byte offset, or index in the encoded corpus) of the
+   input: a hash of seed and the position, so the draws do not depend on how the input is split over threads */
+real token_random(long long position, int draw) {
+    unsigned long long z = seed + (2 * (unsigned long long) position + draw + 1) * 0x9E3779B97F4A7C15ULL; // splitmix64
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return ((z ^ (z >> 31)) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Count, into the tables of t, cooccurrences of target word w1 (frequency rank, not 0) at index j of its line with the
+   span tokens before it (at most the window_size of its configuration) and with their subtokens. Phrases in the
+   vocabulary come split already, as do the others in history. */
+void count_context(COOCTABLES *t, long long w1, long long j, int span, HISTENTRY *history) {
+    long long k;
+    int l;
     real cntxt_weight;
-    HASHREC *htmp1, *htmp2;
+    HISTENTRY *context;
 
-    htmp1 = hashsearch(vocab_hash, str);
-    char *context_str;
+    // Iterate over all words to the left of target word, but not past beginning of line
+    // If token is phrase, iterates also over its subtokens (actually tokens)
+    for (k = j - 1; k >= ( (j > span) ? j - span : 0 ); k--) {
+        cntxt_weight = t->config->distance_weighting ? (1.0/(real)(j-k)) : 1.0;
+        context = &history[k % history_size];
+        if (context->id > 0) count_occour(t, w1, context->id, cntxt_weight); // Process only words in vocabulary
+        for (l = 0; l < context->num_subs; l++) count_occour(t, w1, context->subs[l], cntxt_weight);
+    }
+}
 
+/* Store token w1 (frequency rank, 0 if out of vocabulary) at index j of its line in history, to become context of
+   the tokens after it; out-of-vocabulary words too, since their subtokens may be used. For a phrase out of the
+   vocabulary, oov_subs holds the ranks of its num_oov_subs subtokens. */
+void history_add(HISTENTRY *history, long long j, long long w1, int *oov_subs, int num_oov_subs) {
+    HISTENTRY *context = &history[j % history_size];
+    context->id = w1;
+    if (w1 > 0) {
+        context->subs = phrase_subs + phrase_start[w1];
+        context->num_subs = phrase_start[w1 + 1] - phrase_start[w1];
+    }
+    else {
+        memcpy(context->oov_subs, oov_subs, sizeof(int) * num_oov_subs);
+        context->subs = context->oov_subs;
+        context->num_subs = num_oov_subs;
+    }
+}
 
+/* Fingerprint of the vocabulary (its words and their ranks), stored in encoded corpora to catch a mismatch */
+unsigned long long vocab_fingerprint(HASHTABLE *vocab_hash, long long vocab_size) {
+    unsigned long long fingerprint = vocab_size;
+    long long a;
+    char *word;
+    if (bvocab.data != NULL) {
+        for (a = 1; a <= vocab_size; a++) fingerprint += wordhash(BVOCAB_WORD(&bvocab, a), strlen(BVOCAB_WORD(&bvocab, a))) * (2 * a + 1);
+    }
+    else {
+        for (a = 0; a < vocab_hash->size; a++) {
+            if (vocab_hash->slots[a].hash == 0) continue;
+            word = HASHWORD(vocab_hash, &vocab_hash->slots[a]);
+            fingerprint += wordhash(word, strlen(word)) * (2 * vocab_hash->slots[a].num + 1);
+        }
+    }
+    return fingerprint;
+}
 
-    if (htmp1 == NULL) { // Skip out-of-vocabulary words
-        if (verbose > 2) fprintf(stderr, "Not getting coocurs as word not in vocab\n");
-        // Adds to history anyway since subtokens may be used
-        strcpy(history[j % window_size], str);
-        return; 
+/* Open an encoded corpus for reading (write = 0) or writing (write = 1). When reading, the header must match the
+   vocabulary. Returns 0 on success, 1 on failure. */
+int ids_open(IDSTREAM *s, char *file_name, int write, long long vocab_size, unsigned long long fingerprint) {
+    long long header[3];
+    memset(s, 0, sizeof(IDSTREAM));
+    if ((s->fid = fopen(file_name, write ? "wb" : "rb")) == NULL) {
+        log_file_loading_error("encoded corpus", file_name);
+        return 1;
     }
-    w1 = htmp1->num; // Target word (frequency rank)
-    
-    // Iterate over all words to the left of target word, but not past beginning of line
-    // If token is phrase, iterates also over its subtokens (actually tokens)
-    for (k = j - 1; k >= ( (j > window_size) ? j - window_size : 0 ); k--) { 
-        cntxt_weight = distance_weighting ? (1.0/(real)(j-k)) : 1.0;
-
-        context_str = history[k % window_size]; // Context word
-
-        htmp2 = hashsearch(vocab_hash, context_str);
-        if (htmp2 != NULL) { // Process only words in vocabulary
-            w2 = htmp2->num; // Context word (frequency rank)
-            count_occour(w1, w2, cntxt_weight, lookup, cr, ind, bigram_table);
-        }
-        
-        // For each context_str subtoken, call count_occour if it isnt OOV
-        if (strchr(context_str, SEP_CHAR) != NULL) {
-            for (l = 0, i = 0; context_str[i]; i++, l++) {
-                if (context_str[i] == SEP_CHAR) {
-                    sub_str[l] = '\0';
-                    htmp2 = hashsearch(vocab_hash, sub_str);
-                    if (htmp2 != NULL) {
-                        w2 = htmp2->num;
-                        count_occour(w1, w2, cntxt_weight, lookup, cr, ind, bigram_table);
-                    }
-                    l = -1;
-                }
-                else {
-                    sub_str[l] = context_str[i];
+    if ((s->buf = (int *) malloc(sizeof(int) * IDS_BUFFER)) == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        fclose(s->fid);
+        s->fid = NULL;
+        return 1;
+    }
+    if (write) {
+        memcpy(header, IDS_MAGIC, 8);
+        header[1] = vocab_size;
+        header[2] = (long long) fingerprint;
+        fwrite(header, sizeof(long long), 3, s->fid);
+        return 0;
+    }
+    s->remaining = -1;
+    if (fread(header, sizeof(long long), 3, s->fid) != 3 || memcmp(header, IDS_MAGIC, 8) != 0
+        || header[1] != vocab_size || header[2] != (long long) fingerprint) {
+        fprintf(stderr, "Encoded corpus %s was not written with vocab file %s.\n", file_name, vocab_file);
+        fclose(s->fid);
+        free(s->buf);
+        s->fid = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/* Next int of an encoded corpus; returns 0, or EOF at the end */
+int ids_get(IDSTREAM *s, int *v) {
+    if (s->pos == s->end) {
+        if (s->remaining == 0) return EOF;
+        s->end = fread(s->buf, sizeof(int), (s->remaining >= 0 && s->remaining < IDS_BUFFER) ? s->remaining : IDS_BUFFER, s->fid);
+        s->pos = 0;
+        if (s->end == 0) return EOF;
+        if (s->remaining > 0) s->remaining -= s->end;
+    }
+    *v = s->buf[s->pos++];
+    s->index++;
+    return 0;
+}
+
+void ids_put(IDSTREAM *s, int v) {
+    if (s->pos == IDS_BUFFER) {
+        fwrite(s->buf, sizeof(int), s->pos, s->fid);
+        s->pos = 0;
+    }
+    s->buf[s->pos++] = v;
+}
+
+/* Close an encoded corpus, first writing out what is buffered if it was open for writing */
+void ids_close(IDSTREAM *s, int write) {
+    if (s->fid == NULL) return;
+    if (write) fwrite(s->buf, sizeof(int), s->pos, s->fid);
+    fclose(s->fid);
+    free(s->buf);
+    s->fid = NULL;
+}
+
+/* Next token of the corpus, from ids_in if it is open, else from corpus. Returns EOF at the end, 1 at a newline,
+   2 if ids_in is corrupt, and 0 for a token, setting *w1 to its rank and, for a phrase out of vocabulary, subs to
+   the ranks of its *num_subs subtokens. Tokens and newlines are also appended to ids_out if it is open. */
+int next_token(CORPUSREADER *corpus, IDSTREAM *ids_in, IDSTREAM *ids_out, HASHTABLE *vocab_hash, long long vocab_size, long long *w1, int *subs, int *num_subs) {
+    int flag, len, v, a;
+    char *token;
+
+    *num_subs = 0;
+    if (ids_in->fid != NULL) {
+        if (ids_get(ids_in, &v) == EOF) return EOF;
+        if (v > vocab_size || v < -(2 + MAX_STRING_LENGTH / 2)) return 2;
+        if (verbose > 2) fprintf(stderr, "Maybe processing token id: %d\n", v);
+        flag = (v == IDS_NEWLINE);
+        *w1 = v > 0 ? v : 0;
+        for (a = 0; v < IDS_NEWLINE && a < -v - 2; a++) {
+            if (ids_get(ids_in, &subs[a]) == EOF || subs[a] < 1 || subs[a] > vocab_size) return 2;
+        }
+        *num_subs = a;
+    }
+    else {
+        flag = corpus_next_token(corpus, &token, &len);
+        if (flag == EOF) return EOF;
+        if (flag == 0) {
+            if (verbose > 2) fprintf(stderr, "Maybe processing token: %.*s\n", len, token);
+            *w1 = vocab_rank(vocab_hash, token, len);
+            if (*w1 == 0 && memchr(token, SEP_CHAR, len) != NULL) *num_subs = phrase_subtokens(token, len, vocab_rank, vocab_hash, subs);
+        }
+    }
+    if (ids_out->fid != NULL) {
+        if (flag == 1) ids_put(ids_out, IDS_NEWLINE);
+        else if (*num_subs == 0) ids_put(ids_out, *w1);
+        else {
+            ids_put(ids_out, -(2 + *num_subs));
+            for (a = 0; a < *num_subs; a++) ids_put(ids_out, subs[a]);
+        }
+    }
+    return flag;
+}
+
+/* Build the phrase index: phrase_start[w] .. phrase_start[w + 1] delimit the ranks of the subtokens of word w in
+   phrase_subs. Reads them from phrase_file if given, as written by vocab_count, else splits the words in vocab_hash.
+   Returns 1 on failure, 0 otherwise. */
+int load_phrases(HASHTABLE *vocab_hash, long long vocab_size) {
+    long long a, w, total = 0;
+    int n, l, ids[MAX_STRING_LENGTH / 2 + 1];
+    FILE *fid = NULL;
+
+    phrase_start = (long long *) calloc(vocab_size + 2, sizeof(long long));
+    if (phrase_start == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    // First pass counts the subtokens of each word, second pass stores them
+    for (l = 0; l < 2; l++) {
+        if (phrase_file != NULL) {
+            if ((fid = fopen(phrase_file, "r")) == NULL) {
+                log_file_loading_error("phrase file", phrase_file);
+                return 1;
+            }
+            while (fscanf(fid, "%lld %d", &w, &n) == 2) {
+                if (w < 1 || w > vocab_size || n < 0 || n > MAX_STRING_LENGTH / 2) break;
+                for (a = 0; a < n; a++) if (fscanf(fid, "%d", &ids[a]) != 1 || ids[a] < 1 || ids[a] > vocab_size) break;
+                if (a < n) break;
+                if (l == 0) phrase_start[w + 1] = n;
+                else memcpy(phrase_subs + phrase_start[w], ids, sizeof(int) * n);
+            }
+            if (!feof(fid)) {
+                fprintf(stderr, "Phrase file \"%s\" does not match vocab file \"%s\".\n", phrase_file, vocab_file);
+                fclose(fid);
+                return 1;
+            }
+            fclose(fid);
+        }
+        else if (bvocab.data != NULL) {
+            for (w = 1; w <= vocab_size; w++) {
+                n = phrase_subtokens(BVOCAB_WORD(&bvocab, w), strlen(BVOCAB_WORD(&bvocab, w)), vocab_rank, vocab_hash, ids);
+                if (l == 0) phrase_start[w + 1] = n;
+                else memcpy(phrase_subs + phrase_start[w], ids, sizeof(int) * n);
+            }
+        }
+        else {
+            for (a = 0; a < vocab_hash->size; a++) {
+                if (vocab_hash->slots[a].hash == 0) continue;
+                w = vocab_hash->slots[a].num;
+                n = phrase_subtokens(HASHWORD(vocab_hash, &vocab_hash->slots[a]), strlen(HASHWORD(vocab_hash, &vocab_hash->slots[a])), vocab_rank, vocab_hash, ids);
+                if (l == 0) phrase_start[w + 1] = n;
+                else memcpy(phrase_subs + phrase_start[w], ids, sizeof(int) * n);
+            }
+        }
+        if (l == 1) break;
+        for (w = 1; w <= vocab_size; w++) phrase_start[w + 1] += phrase_start[w];
+        total = phrase_start[vocab_size + 1];
+        if ((phrase_subs = (int *) malloc(sizeof(int) * (total + 1))) == NULL) {
+            fprintf(stderr, "Couldn't allocate memory!");
+            return 1;
+        }
+    }
+    if (verbose > 1) fprintf(stderr, "%lld phrase subtokens in vocabulary.\n", total);
+    return 0;
+}
+
+/* One thread's share of the counting: a range of the corpus, counted into private tables */
+typedef struct cooccur_thread {
+    CORPUSREADER corpus; // range of the text corpus
+    IDSTREAM ids_in, ids_out; // range of the encoded corpus, if reading one; where to encode this range, if writing one
+    HASHTABLE *vocab_hash;
+    long long vocab_size;
+    COOCTABLES *tables; // one per configuration
+    long long tokens;
+    long long dropped; // tokens subsampled away
+    long long position; // in the input, at the start of a line, up to which its tables hold the counts of its range
+    int status;
+} COOCTHREAD;
+
+/* One thread's block of a pass of the radix sort */
+typedef struct radix_task {
+    CREC *src, *dst;
+    long long start, end;
+    int shift; // of the digit sorted on in this pass
+    long long count[256]; // histogram of the digit in the block, then where the block's records with each digit go in dst
+} RADIXTASK;
+
+void *radix_count(void *arg) {
+    RADIXTASK *t = (RADIXTASK *) arg;
+    long long a;
+    memset(t->count, 0, sizeof(t->count));
+    for (a = t->start; a < t->end; a++) t->count[(CREC_KEY(t->src[a]) >> t->shift) & 255]++;
+    return NULL;
+}
+
+void *radix_scatter(void *arg) {
+    RADIXTASK *t = (RADIXTASK *) arg;
+    long long a;
+    for (a = t->start; a < t->end; a++) t->dst[t->count[(CREC_KEY(t->src[a]) >> t->shift) & 255]++] = t->src[a];
+    return NULL;
+}
+
+/* Sort the length records of cr by (word1, word2) with a stable LSD radix sort on bytes of the packed key, using
+   buffer (as long as cr) as scratch. Bytes equal in all records are skipped, so usually only about half of the 8
+   passes run. Each pass is split over num_threads threads. Returns whichever of cr and buffer holds the result. */
+CREC *radix_sort(CREC *cr, CREC *buffer, long long length) {
+    int a, b, shift, threads = length / 65536 < num_threads ? (int) (length / 65536) : num_threads;
+    unsigned long long differ = 0, first;
+    long long offset, size;
+    CREC *tmp;
+    RADIXTASK *tasks;
+    pthread_t *pt;
+
+    if (length < 2) return cr;
+    if (threads < 1) threads = 1;
+    tasks = (RADIXTASK *) malloc(sizeof(RADIXTASK) * threads);
+    pt = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+    first = CREC_KEY(cr[0]);
+    for (offset = 1; offset < length; offset++) differ |= CREC_KEY(cr[offset]) ^ first;
+    for (shift = 0; shift < 64; shift += 8) {
+        if (((differ >> shift) & 255) == 0) continue; // all records agree on this byte
+        for (a = 0; a < threads; a++) {
+            tasks[a].src = cr;
+            tasks[a].dst = buffer;
+            tasks[a].start = length / threads * a;
+            tasks[a].end = (a == threads - 1) ? length : length / threads * (a + 1);
+            tasks[a].shift = shift;
+            if (threads > 1) pthread_create(&pt[a], NULL, radix_count, (void *)&tasks[a]);
+            else radix_count((void *)&tasks[a]);
+        }
+        if (threads > 1) for (a = 0; a < threads; a++) pthread_join(pt[a], NULL);
+        // Records with smaller digits go first; within a digit, blocks keep their order, so the sort is stable
+        for (b = 0, offset = 0; b < 256; b++) {
+            for (a = 0; a < threads; a++) {
+                size = tasks[a].count[b];
+                tasks[a].count[b] = offset;
+                offset += size;
+            }
+        }
+        if (threads > 1) {
+            for (a = 0; a < threads; a++) pthread_create(&pt[a], NULL, radix_scatter, (void *)&tasks[a]);
+            for (a = 0; a < threads; a++) pthread_join(pt[a], NULL);
+        }
+        else radix_scatter((void *)&tasks[0]);
+        tmp = cr; cr = buffer; buffer = tmp;
+    }
+    free(tasks);
+    free(pt);
+    return cr;
+}
+
+/* Sort the length records in cr and write them, accumulating duplicates, to a new temporary file, a run of
+   configuration config. buffer, as long as cr, is scratch space for the sort; if it is NULL, sort with qsort instead.
+   Returns 1 on failure, 0 otherwise. */
+int write_overflow(CREC *cr, CREC *buffer, long long length, int config) {
+    char filename[200];
+    FILE *foverflow;
+    int num;
+    if (buffer != NULL) cr = radix_sort(cr, buffer, length);
+    else qsort(cr, length, sizeof(CREC), compare_crec);
+    pthread_mutex_lock(&fidcounter_lock);
+    num = ++fidcounter;
+    pthread_mutex_unlock(&fidcounter_lock);
+    sprintf(filename,"%s_%04d.bin",file_head,num);
+    if ((foverflow = fopen(filename,"wb")) == NULL) {
+        log_file_loading_error("temp file", filename);
+        return 1;
+    }
+    write_chunk(cr,length,foverflow);
+    fclose(foverflow);
+    pthread_mutex_lock(&fidcounter_lock);
+    num = add_run(num, 0, num, config);
+    pthread_mutex_unlock(&fidcounter_lock);
+    return num;
+}
+
+/* Add the mirror images (word2, word1) of the records of temporary file id above the diagonal, sorted, as new runs of
+   configuration config. Returns 1 on failure, 0 otherwise. */
+int mirror_runs(int id, int config) {
+    long long a, n, ind = 0, length = overflow_length * num_threads; // the counting threads' overflow buffers are free
+    int status = 0;
+    char filename[MAX_STRING_LENGTH + 20];
+    CRECREADER reader;
+    CREC *in = (CREC *) malloc(sizeof(CREC) * MERGE_BUFFER), *cr = (CREC *) malloc(sizeof(CREC) * (length + 1));
+    CREC *buffer = (CREC *) malloc(sizeof(CREC) * (length + 1)); // if this fails, qsort
+
+    sprintf(filename,"%s_%04d.bin",file_head,id);
+    if (in == NULL || cr == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        status = 1;
+    }
+    else if (crec_reader_open(&reader, filename, MERGE_BUFFER) != 0) status = log_file_loading_error("temp file", filename);
+    else {
+        while (status == 0 && (n = crec_reader_read(&reader, in, MERGE_BUFFER)) > 0) {
+            for (a = 0; a < n && status == 0; a++) {
+                if (in[a].word1 == in[a].word2) continue;
+                add_record(cr, &ind, in[a].word2, in[a].word1, in[a].val);
+                if (ind == length) {
+                    status = write_overflow(cr, buffer, ind, config);
+                    ind = 0;
                 }
             }
         }
+        if (status == 0 && ind > 0) status = write_overflow(cr, buffer, ind, config);
+        crec_reader_close(&reader);
     }
+    free(in);
+    free(cr);
+    free(buffer);
+    return status;
+}
 
-    // Target word is stored in circular buffer to become context word in the future
-    strcpy(history[j % window_size], str);
+/* Write out the records counted in the tables of configuration config beyond the dense table: what is left in the
+   overflow buffer, and the band table as one more run, its pairs packed at the start, emptying it. Returns 1 on
+   failure, 0 otherwise. */
+int tables_flush(COOCTABLES *t, int config) {
+    long long a, n;
+    int status = 0;
+    batch_flush(t);
+    if (t->ind > 0) {
+        if (t->buffer == NULL) t->buffer = (CREC *) malloc(sizeof(CREC) * (t->ind + 1)); // if this fails, qsort
+        status = write_overflow(t->cr, t->buffer, t->ind, config);
+        t->ind = 0;
+    }
+    free(t->buffer);
+    t->buffer = NULL;
+    if (status == 0 && t->band.count > 0) {
+        for (a = 0, n = 0; a < t->band.size; a++) if (t->band.slots[a].word1 != 0) t->band.slots[n++] = t->band.slots[a];
+        t->buffer = (CREC *) malloc(sizeof(CREC) * (n + 1)); // if this fails, qsort
+        status = write_overflow(t->band.slots, t->buffer, n, config);
+        free(t->buffer);
+        t->buffer = NULL;
+        memset(t->band.slots, 0, sizeof(CREC) * t->band.size);
+        t->band.count = 0;
+        if (verbose > 2) fprintf(stderr, "\n%lld pairs counted in the band table.\n", n);
+    }
+    return status;
 }
 
-/* Collect word-word cooccurrence counts from input stream */
-int get_cooccurrence() {
-    int flag, x, y, fidcounter = 1;
-    long long a, j = 0, id, counter = 0, ind = 0, vocab_size, *lookup = NULL;
-    char format[20], filename[200], str[MAX_STRING_LENGTH + 1];
-    char history[window_size][MAX_STRING_LENGTH + 1], sub_str[MAX_STRING_LENGTH + 1];
-    FILE *fid, *foverflow;
-    real *bigram_table = NULL, r;
-    HASHREC **vocab_hash = inithashtable();
-    CREC *cr = malloc(sizeof(CREC) * (overflow_length + 1));
-    
-    fprintf(stderr, "COUNTING COOCCURRENCES\n");
-    if (verbose > 0) {
-        fprintf(stderr, "window size: %d\n", window_size);
-        if (symmetric == 0) fprintf(stderr, "context: asymmetric\n");
-        else fprintf(stderr, "context: symmetric\n");
+/* Pause a counting thread at position, the start of a line, for a checkpoint: write out the records of its tables
+   beyond the dense tables as runs, and wait until the checkpoint is written. Returns 1 on failure, 0 otherwise. */
+int checkpoint_pause(COOCTHREAD *t, long long position) {
+    int c, status = 0;
+    for (c = 0; c < num_configs && status == 0; c++) status = tables_flush(&t->tables[c], c);
+    if (status != 0) return 1;
+    t->position = position;
+    pthread_mutex_lock(&fidcounter_lock);
+    checkpoint_paused++;
+    pthread_cond_broadcast(&checkpoint_cond);
+    while (__atomic_load_n(&checkpoint_due, __ATOMIC_ACQUIRE)) pthread_cond_wait(&checkpoint_cond, &fidcounter_lock);
+    checkpoint_paused--;
+    pthread_mutex_unlock(&fidcounter_lock);
+    return 0;
+}
+
+/* Count cooccurrences in one thread's range of the corpus, for every configuration */
+void *count_thread(void *arg) {
+    COOCTHREAD *t = (COOCTHREAD *) arg;
+    int flag, c, subs[MAX_STRING_LENGTH / 2 + 1], num_subs;
+    long long j = 0, w1, position = 0;
+    real draw = 1;
+    HISTENTRY *history = malloc(sizeof(HISTENTRY) * history_size);
+    COOCTABLES *tables;
+
+    t->status = 0; // tokens and dropped start from zero, or from a checkpoint
+    if (history == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        t->status = 1;
+        return NULL;
     }
-    if (verbose > 1) fprintf(stderr, "max product: %lld\n", max_product);
-    if (verbose > 1) fprintf(stderr, "overflow length: %lld\n", overflow_length);
-    sprintf(format,"%%%ds %%lld", MAX_STRING_LENGTH); // Format to read from vocab file, which has (irrelevant) frequency data
-    if (verbose > 1) fprintf(stderr, "Reading vocab from file \"%s\"...", vocab_file);
-    fid = fopen(vocab_file,"r");
-    if (fid == NULL) { 
-        log_file_loading_error("vocab file", vocab_file);
-        free_resources(vocab_hash, cr, lookup, bigram_table);
+    /* For each token in input stream, calculate a weighted cooccurrence sum within window_size */
+    while (1) {
+        for (c = 0; c < num_configs && t->status == 0; c++) {
+            tables = &t->tables[c];
+            if (tables->ind >= tables->threshold) {
+                // If overflow buffer is (almost) full, sort it and write it to temporary file
+                if (tables->buffer == NULL) tables->buffer = (CREC *) malloc(sizeof(CREC) * (tables->config->overflow_length + 1 + TABLE_BATCH)); // if this fails, qsort
+                t->status = write_overflow(tables->cr, tables->buffer, tables->ind, c);
+                tables->ind = 0;
+            }
+        }
+        if (t->status != 0) break;
+        flag = next_token(&t->corpus, &t->ids_in, &t->ids_out, t->vocab_hash, t->vocab_size, &w1, subs, &num_subs);
+        position = t->ids_in.fid != NULL ? t->ids_in.index : corpus_offset(&t->corpus); // just past the token
+        if (flag == 2) {
+            fprintf(stderr, "\nEncoded corpus %s is corrupt.\n", ids_in_file);
+            t->status = 1;
+            break;
+        }
+        if (flag == EOF) {
+            if (verbose > 2) fprintf(stderr, "Not getting coocurs as at eof\n");
+            break;
+        }
+        if (flag == 1) {
+            // Newline, reset line index (j)
+            j = 0;
+            if (verbose > 2) fprintf(stderr, "Not getting coocurs as at newline\n");
+            if (__atomic_load_n(&checkpoint_due, __ATOMIC_ACQUIRE) && (t->status = checkpoint_pause(t, position)) != 0) break;
+            continue;
+        }
+        t->tokens++;
+        if ((t->tokens%100000) == 0){
+            if (verbose > 1 && num_threads == 1) fprintf(stderr,"\033[19G%lld",t->tokens);
+        }
+        // A subsampled token is dropped from the line, so the window reaches past it as if it were not there
+        if (keep_prob != NULL && w1 > 0 && keep_prob[w1] < 1 && token_random(position, 0) >= keep_prob[w1]) {
+            t->dropped++;
+            continue;
+        }
+        if (w1 > 0) {
+            // The token is counted once for each configuration; a dynamic window shrinks all of theirs alike
+            if (dynamic_window) draw = token_random(position, 1);
+            for (c = 0; c < num_configs; c++) {
+                count_context(&t->tables[c], w1, j, dynamic_window ? 1 + (int) (draw * configs[c].window_size) : configs[c].window_size, history);
+            }
+        }
+        else if (verbose > 2) fprintf(stderr, "Not getting coocurs as word not in vocab\n");
+        history_add(history, j, w1, subs, num_subs);
+        j++;
+    }
+    for (c = 0; c < num_configs; c++) {
+        if (t->status == 0) t->status = tables_flush(&t->tables[c], c);
+    }
+    free(history);
+    // Done, or failed: a checkpoint no longer waits for this thread, and is not written if it failed
+    t->position = position;
+    pthread_mutex_lock(&fidcounter_lock);
+    checkpoint_paused++;
+    pthread_cond_broadcast(&checkpoint_cond);
+    pthread_mutex_unlock(&fidcounter_lock);
+    return NULL;
+}
+
+/* Split the encoded corpus into num ranges of ints [starts[a], starts[a + 1]) that begin at the start of a line.
+   Returns 1 if the file can't be read, 0 otherwise. */
+int ids_split(char *file_name, int num, long long *starts) {
+    long long a, length;
+    int v;
+    FILE *fid = fopen(file_name, "rb");
+    if (fid == NULL) return 1;
+    fseek(fid, 0, SEEK_END);
+    length = (ftell(fid) - 3 * (long long) sizeof(long long)) / sizeof(int);
+    starts[0] = 0;
+    starts[num] = length > 0 ? length : 0;
+    for (a = 1; a < num; a++) {
+        starts[a] = length / num * a;
+        if (starts[a] < starts[a - 1]) starts[a] = starts[a - 1];
+        if (starts[a] == 0) continue;
+        // Move to just after the next newline, looking from the int before
+        fseek(fid, 3 * sizeof(long long) + (starts[a] - 1) * sizeof(int), SEEK_SET);
+        for (starts[a]--; fread(&v, sizeof(int), 1, fid) == 1 && v != IDS_NEWLINE; starts[a]++);
+        starts[a] = starts[a] + 1 < starts[num] ? starts[a] + 1 : starts[num];
+    }
+    fclose(fid);
+    return 0;
+}
+
+/* Give each thread its range of the corpus (text or encoded) and, when encoding, its own output file.
+   Returns 1 on failure, 0 otherwise. */
+int open_ranges(COOCTHREAD *threads, CORPUSREADER *corpus, unsigned long long fingerprint) {
+    long long a, *starts = (long long *) malloc((num_threads + 1) * sizeof(long long));
+    char filename[MAX_STRING_LENGTH + 20];
+    int status = 0;
+
+    if (ids_in_file != NULL) {
+        if ((status = ids_split(ids_in_file, num_threads, starts)) != 0) log_file_loading_error("encoded corpus", ids_in_file);
+    }
+    else if (corpus_split(corpus, num_threads, starts) != 0) {
+        if (num_threads > 1) {
+            fprintf(stderr, "Error, -threads requires a corpus file that can be mapped into memory.\n");
+            status = 1;
+        }
+        starts[0] = starts[1] = 0; // one thread reads the whole stream
+    }
+    for (a = 0; status == 0 && a < num_threads; a++) {
+        if (ids_in_file != NULL) {
+            if ((status = ids_open(&threads[a].ids_in, ids_in_file, 0, threads[a].vocab_size, fingerprint)) != 0) break;
+            fseek(threads[a].ids_in.fid, 3 * sizeof(long long) + starts[a] * sizeof(int), SEEK_SET);
+            threads[a].ids_in.remaining = starts[a + 1] - starts[a];
+            threads[a].ids_in.index = starts[a];
+        }
+        else if (corpus->mapped) corpus_view(&threads[a].corpus, corpus, starts[a], starts[a + 1]);
+        else threads[a].corpus = *corpus;
+        if (ids_out_file != NULL) {
+            if (a == 0) strcpy(filename, ids_out_file);
+            else sprintf(filename, "%s_ids_%04lld.bin", file_head, a);
+            status = ids_open(&threads[a].ids_out, filename, 1, threads[a].vocab_size, fingerprint);
+        }
+    }
+    free(starts);
+    return status;
+}
+
+/* Close the thread ranges; when encoding, append the other threads' encoded ranges to that of thread 0, in order */
+int close_ranges(COOCTHREAD *threads) {
+    long long a, length;
+    char filename[MAX_STRING_LENGTH + 20];
+    int status = 0, *buf = NULL;
+    FILE *fid, *fout = NULL;
+
+    for (a = 0; a < num_threads; a++) {
+        ids_close(&threads[a].ids_in, 0);
+        ids_close(&threads[a].ids_out, 1);
+    }
+    if (ids_out_file == NULL || num_threads == 1) return 0;
+    if ((buf = (int *) malloc(sizeof(int) * IDS_BUFFER)) == NULL || (fout = fopen(ids_out_file, "ab")) == NULL) status = 1;
+    for (a = 1; a < num_threads; a++) {
+        sprintf(filename, "%s_ids_%04lld.bin", file_head, a);
+        if ((fid = fopen(filename, "rb")) == NULL) {status = 1; continue;}
+        fseek(fid, 3 * sizeof(long long), SEEK_SET);
+        while (status == 0 && (length = fread(buf, sizeof(int), IDS_BUFFER, fid)) > 0) fwrite(buf, sizeof(int), length, fout);
+        fclose(fid);
+        remove(filename);
+    }
+    if (fout != NULL) fclose(fout);
+    free(buf);
+    if (status != 0) fprintf(stderr, "Couldn't write encoded corpus %s.\n", ids_out_file);
+    return status;
+}
+
+/* Checkpoints of the counting (-checkpoint, -resume), in <file_head>_checkpoint.bin: after CHECKPOINT_MAGIC, the
+   settings that must match to resume, then fidcounter and the list of runs, then for each thread the position it
+   counted up to, its token counts and its dense tables. Its runs are the temporary files listed. */
+typedef struct checkpoint_task {
+    COOCTHREAD *threads;
+    unsigned long long fingerprint;
+} CHECKPOINTTASK;
+
+/* The settings a checkpoint records and resuming must match, CHECKPOINT_HEADER long longs; NULL if out of memory */
+long long *checkpoint_header(COOCTHREAD *threads, unsigned long long fingerprint) {
+    int c;
+    long long *header = (long long *) calloc(CHECKPOINT_HEADER, sizeof(long long));
+    if (header == NULL) return NULL;
+    header[0] = threads[0].vocab_size;
+    header[1] = (long long) fingerprint;
+    header[2] = num_threads;
+    header[3] = num_configs;
+    header[4] = counter_bytes;
+    header[5] = ids_in_file != NULL;
+    header[6] = dynamic_window;
+    header[7] = (long long) seed;
+    memcpy(&header[8], &subsample, sizeof(real));
+    for (c = 0; c < num_configs; c++) {
+        header[9 + 4 * c] = 4 * configs[c].window_size + 2 * (configs[c].symmetric > 0) + (configs[c].distance_weighting != 0);
+        header[10 + 4 * c] = configs[c].counter_type;
+        header[11 + 4 * c] = configs[c].max_product;
+        header[12 + 4 * c] = configs[c].lookup[threads[0].vocab_size];
+    }
+    return header;
+}
+
+/* Write a checkpoint of the paused counting threads: the temporary files it lists are synced, then it is written to a
+   new file that replaces the last one. fidcounter_lock must be held. Returns 1 on failure, 0 otherwise. */
+int checkpoint_write(COOCTHREAD *threads, unsigned long long fingerprint) {
+    char filename[MAX_STRING_LENGTH + 20], tmpname[MAX_STRING_LENGTH + 20];
+    long long a, n, *header;
+    int c, fd, status = 0;
+    FILE *fout;
+
+    for (a = 0; a < num_runs && status == 0; a++) {
+        sprintf(filename,"%s_%04d.bin",file_head,runs[a].id);
+        if ((fd = open(filename, O_RDONLY)) < 0 || fsync(fd) != 0) status = 1;
+        if (fd >= 0) close(fd);
+    }
+    sprintf(tmpname, "%s_checkpoint.tmp", file_head);
+    sprintf(filename, "%s_checkpoint.bin", file_head);
+    if (status != 0 || (header = checkpoint_header(threads, fingerprint)) == NULL) return 1;
+    if ((fout = fopen(tmpname, "wb")) == NULL) {
+        free(header);
+        return 1;
+    }
+    fwrite(CHECKPOINT_MAGIC, 1, 8, fout);
+    fwrite(header, sizeof(long long), CHECKPOINT_HEADER, fout);
+    free(header);
+    fwrite(&fidcounter, sizeof(int), 1, fout);
+    fwrite(&num_runs, sizeof(int), 1, fout);
+    fwrite(runs, sizeof(RUNFILE), num_runs, fout);
+    for (a = 0; a < num_threads; a++) {
+        fwrite(&threads[a].position, sizeof(long long), 1, fout);
+        fwrite(&threads[a].tokens, sizeof(long long), 1, fout);
+        fwrite(&threads[a].dropped, sizeof(long long), 1, fout);
+        for (c = 0; c < num_configs; c++) {
+            n = configs[c].lookup[threads[a].vocab_size];
+            if ((long long) fwrite(threads[a].tables[c].bigram_table, counter_bytes, n, fout) != n) status = 1;
+        }
+    }
+    if (fflush(fout) != 0 || fsync(fileno(fout)) != 0) status = 1;
+    if (fclose(fout) != 0) status = 1;
+    if (status == 0 && rename(tmpname, filename) != 0) status = 1;
+    if (status != 0) remove(tmpname);
+    return status;
+}
+
+/* Write a checkpoint every checkpoint_minutes while counting: ask the counting threads to pause at the start of their
+   next line, wait for them and for the compaction thread to finish its group, write it, and let them go on. The
+   temporary files retired since the last checkpoint go once it is written. */
+void *checkpoint_thread(void *arg) {
+    CHECKPOINTTASK *k = (CHECKPOINTTASK *) arg;
+    struct timespec due;
+    long long nanoseconds;
+    int a, failed;
+
+    pthread_mutex_lock(&fidcounter_lock);
+    while (!counting_done) {
+        clock_gettime(CLOCK_REALTIME, &due);
+        nanoseconds = due.tv_nsec + (long long) (checkpoint_minutes * 60e9);
+        due.tv_sec += nanoseconds / 1000000000;
+        due.tv_nsec = nanoseconds % 1000000000;
+        while (!counting_done && pthread_cond_timedwait(&checkpoint_cond, &fidcounter_lock, &due) != ETIMEDOUT);
+        if (counting_done) break;
+        __atomic_store_n(&checkpoint_due, 1, __ATOMIC_RELEASE);
+        while (checkpoint_paused < num_threads || compacting) pthread_cond_wait(&checkpoint_cond, &fidcounter_lock);
+        for (a = 0, failed = compact_status; a < num_threads; a++) failed |= k->threads[a].status;
+        if (failed == 0) {
+            // A checkpoint that can't be written leaves the last one, and the files it lists, in place
+            if (checkpoint_write(k->threads, k->fingerprint) != 0) fprintf(stderr, "\nCouldn't write checkpoint %s_checkpoint.bin.\n", file_head);
+            else {
+                remove_retired();
+                if (verbose > 2) fprintf(stderr, "\nWrote checkpoint %s_checkpoint.bin, %d files.\n", file_head, num_runs);
+            }
+        }
+        __atomic_store_n(&checkpoint_due, 0, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&checkpoint_cond);
+        pthread_cond_broadcast(&runs_cond);
+    }
+    pthread_mutex_unlock(&fidcounter_lock);
+    return NULL;
+}
+
+/* Resume from the checkpoint of an earlier run with the same settings: take up its runs and the threads' tables and
+   counts, move each thread on to the position it counted up to, and remove the temporary files the checkpoint does not
+   list. Returns 1 on failure, 0 otherwise. */
+int checkpoint_load(COOCTHREAD *threads, unsigned long long fingerprint) {
+    char filename[MAX_STRING_LENGTH + 20], magic[8], *word;
+    long long a, n, tokens = 0, *header, *saved;
+    int c, id, last, count, missing, len, *listed = NULL, status = 0;
+    RUNFILE run;
+    FILE *fid;
+
+    sprintf(filename, "%s_checkpoint.bin", file_head);
+    if ((fid = fopen(filename, "rb")) == NULL) return log_file_loading_error("checkpoint", filename);
+    header = checkpoint_header(threads, fingerprint);
+    saved = (long long *) malloc(sizeof(long long) * CHECKPOINT_HEADER);
+    if (header == NULL || saved == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        status = 1;
+    }
+    else if (fread(magic, 1, 8, fid) != 8 || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0
+        || fread(saved, sizeof(long long), CHECKPOINT_HEADER, fid) != (size_t) CHECKPOINT_HEADER
+        || memcmp(header, saved, sizeof(long long) * CHECKPOINT_HEADER) != 0) {
+        fprintf(stderr, "Checkpoint %s was not written by a run with this vocabulary, input, -threads, memory plan and configurations.\n", filename);
+        status = 1;
+    }
+    free(header);
+    free(saved);
+    if (status != 0) {
+        fclose(fid);
         return 1;
     }
-    while (fscanf(fid, format, str, &id) != EOF){
-        // Here id is not used: inserting vocab words into hash table with their frequency rank, j
-        // vocab_file is a list of (word, count) entries, sorted non-ascending by count
-        hashinsert(vocab_hash, str, ++j); 
+    if (fread(&last, sizeof(int), 1, fid) != 1 || fread(&count, sizeof(int), 1, fid) != 1
+        || (listed = (int *) calloc(last + 1, sizeof(int))) == NULL) status = 1;
+    for (a = 0; a < count && status == 0; a++) {
+        if (fread(&run, sizeof(RUNFILE), 1, fid) != 1 || run.id < 1 || run.id > last) status = 1;
+        else status = add_run(run.id, run.level, run.key, run.config);
+        if (status == 0) listed[run.id] = 1;
+    }
+    for (a = 0; a < num_threads && status == 0; a++) {
+        if (fread(&threads[a].position, sizeof(long long), 1, fid) != 1 || fread(&threads[a].tokens, sizeof(long long), 1, fid) != 1
+            || fread(&threads[a].dropped, sizeof(long long), 1, fid) != 1) status = 1;
+        for (c = 0; c < num_configs && status == 0; c++) {
+            n = configs[c].lookup[threads[a].vocab_size];
+            if ((long long) fread(threads[a].tables[c].bigram_table, counter_bytes, n, fid) != n) status = 1;
+        }
+        tokens += threads[a].tokens;
     }
-        
     fclose(fid);
-    vocab_size = j;
-    j = 0;
-    if (verbose > 1) fprintf(stderr, "loaded %lld words.\nBuilding lookup table...", vocab_size);
+    if (status != 0) {
+        free(listed);
+        fprintf(stderr, "Checkpoint %s is corrupt.\n", filename);
+        return 1;
+    }
     
-    /* Build auxiliary lookup table used to index into bigram_table */
-    lookup = (long long *)calloc( vocab_size + 1, sizeof(long long) );
-    if (lookup == NULL) {
+    /* Each thread goes on from the start of the line it paused at */
+    for (a = 0; a < num_threads; a++) {
+        if (ids_in_file != NULL) {
+            threads[a].ids_in.remaining -= threads[a].position - threads[a].ids_in.index;
+            threads[a].ids_in.index = threads[a].position;
+            fseek(threads[a].ids_in.fid, 3 * sizeof(long long) + threads[a].position * sizeof(int), SEEK_SET);
+        }
+        else if (threads[a].corpus.mapped) threads[a].corpus.pos = threads[a].position - threads[a].corpus.offset;
+        else while (corpus_offset(&threads[a].corpus) < threads[a].position && corpus_next_token(&threads[a].corpus, &word, &len) != EOF);
+    }
+    
+    /* Files written after the checkpoint, or merged into others before it, are not part of it */
+    for (id = 1; id <= last; id++) {
+        if (listed[id]) continue;
+        sprintf(filename,"%s_%04d.bin",file_head,id);
+        remove(filename);
+    }
+    for (id = last + 1, missing = 0; missing < 64; id++) {
+        sprintf(filename,"%s_%04d.bin",file_head,id);
+        missing = remove(filename) == 0 ? 0 : missing + 1;
+    }
+    fidcounter = last;
+    free(listed);
+    if (verbose > 1) fprintf(stderr, "Resuming from checkpoint %s_checkpoint.bin: %lld tokens counted, %d files.\n", file_head, tokens, count);
+    return 0;
+}
+
+/* Add the dense tables of the other threads into that of thread 0, each reducer over its own slice of the table */
+typedef struct reduce_task {
+    COOCTHREAD *threads;
+    int config; // whose tables are added
+    long long start, end;
+    long long *lookup;
+    CREC *carry; // records of the unsigned counts that wrapped around in the sum
+    long long num_carry, max_carry;
+    int status;
+} REDUCETASK;
+
+/* Keep the UINT_WRAP lost by cell index of the summed table as an overflow record */
+int reduce_carry(REDUCETASK *r, long long index) {
+    long long lo = 1, hi = r->threads[0].vocab_size, mid;
+    CREC *tmp;
+    if (r->num_carry == r->max_carry) {
+        r->max_carry = r->max_carry == 0 ? 1024 : 2 * r->max_carry;
+        if ((tmp = (CREC *) realloc(r->carry, sizeof(CREC) * r->max_carry)) == NULL) return 1;
+        r->carry = tmp;
+    }
+    // The row x of the cell is the first with index < lookup[x] - 1; invert CELL for its column
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index < r->lookup[mid] - 1) hi = mid;
+        else lo = mid + 1;
+    }
+    add_record(r->carry, &r->num_carry, lo, index - r->lookup[lo - 1] + 1 + (symmetric > 0 ? lo : 1), UINT_WRAP);
+    return 0;
+}
+
+void *reduce_thread(void *arg) {
+    REDUCETASK *r = (REDUCETASK *) arg;
+    long long a, b;
+    unsigned int *usum = (unsigned int *) r->threads[0].tables[r->config].bigram_table, *u;
+    float *fsum = (float *) r->threads[0].tables[r->config].bigram_table, *f;
+    real *sum = (real *) r->threads[0].tables[r->config].bigram_table, *d;
+    r->status = 0;
+    for (b = 1; b < num_threads; b++) {
+        if (counter_type == COUNTER_UINT) {
+            u = (unsigned int *) r->threads[b].tables[r->config].bigram_table;
+            for (a = r->start; a < r->end; a++) {
+                if ((usum[a] += u[a]) < u[a]) r->status |= reduce_carry(r, a);
+            }
+        }
+        else if (counter_type == COUNTER_FLOAT) {
+            f = (float *) r->threads[b].tables[r->config].bigram_table;
+            for (a = r->start; a < r->end; a++) fsum[a] += f[a];
+        }
+        else {
+            d = (real *) r->threads[b].tables[r->config].bigram_table;
+            for (a = r->start; a < r->end; a++) sum[a] += d[a];
+        }
+    }
+    return NULL;
+}
+
+/* Fill keep_prob for subsample from the counts[0 .. vocab_size - 1] of the words of ranks 1 .. vocab_size, with the
+   formula of word2vec. Returns 1 on failure, 0 otherwise. */
+int subsample_init(long long *counts, long long vocab_size) {
+    long long a, total = 0;
+    real threshold;
+    if ((keep_prob = (real *) malloc(sizeof(real) * (vocab_size + 1))) == NULL) {
         fprintf(stderr, "Couldn't allocate memory!");
-        free_resources(vocab_hash, cr, lookup, bigram_table);
         return 1;
     }
+    for (a = 0; a < vocab_size; a++) total += counts[a];
+    threshold = subsample * total;
+    keep_prob[0] = 1;
+    for (a = 1; a <= vocab_size; a++) {
+        keep_prob[a] = counts[a - 1] > 0 ? (sqrt(counts[a - 1] / threshold) + 1) * threshold / counts[a - 1] : 1;
+        if (keep_prob[a] > 1) keep_prob[a] = 1;
+    }
+    return 0;
+}
+
+/* Cells of the dense table for a max product; see the lookup table in get_cooccurrence */
+long long table_cells(long long product, long long vocab_size) {
+    long long a, last, cells = 0;
+    for (a = 1; a <= vocab_size; a++) {
+        last = (product / a < vocab_size) ? product / a : vocab_size;
+        if (symmetric > 0) last = (last >= a) ? last - a + 1 : 0;
+        if (last == 0) break; // rows only get shorter
+        cells += last;
+    }
+    return cells;
+}
+
+/* Smallest product in [lo, hi] whose dense table has more than cells cells, or hi */
+long long product_for_cells(long long cells, long long lo, long long hi, long long vocab_size) {
+    long long mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (table_cells(mid, vocab_size) > cells) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+/* Expected fraction of the pairs counted that miss a table with cutoff product, if words cooccur independently with
+   the frequencies of the vocabulary: the pairs of target t and context c with (c + 1) * t > product. cum[k] is the
+   share of the words of ranks 1 .. k in the corpus. */
+real miss_fraction(real *cum, long long product, long long vocab_size) {
+    long long t, c;
+    real miss = 0;
+    for (t = 1; t <= vocab_size; t++) {
+        c = product / t - 1; // contexts of ranks 1 .. c are in the table
+        miss += (cum[t] - cum[t - 1]) * (1 - cum[c < 0 ? 0 : c > vocab_size ? vocab_size : c]);
+    }
+    return miss;
+}
+
+/* Size the dense table, band table and overflow buffer of each thread, and the read buffers of the merge, of the
+   configuration in the globals to its share of memory_limit (all num_configs get the same), from the actual vocabulary
+   (whose words have counts[0 .. vocab_size - 1] and take fixed bytes with the other tables that do not depend on the
+   plan), unless given on the command line. Prints the plan, with the peak memory, temporary disk and number of runs
+   predicted from the counts, if verbose or dry_run. Returns 1 if memory_limit is too small, 0 otherwise. */
+int plan_memory(long long *counts, long long vocab_size, long long fixed) {
+    long long a, total = 0, cells, per_thread, overflow_bytes, runs, merge_peak, count_peak, mirror_peak, share, others;
+    real budget = memory_limit * 1073741824 * 0.95, pairs, overflow_records, kept = 0; // some room for the allocator and stacks
+    real *cum = (real *) malloc(sizeof(real) * (vocab_size + 1));
+
+    if (cum == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    // The distribution is that of the tokens left after subsampling
+    for (a = 0; a < vocab_size; a++) {
+        total += counts[a];
+        kept += keep_prob != NULL ? counts[a] * keep_prob[a + 1] : counts[a];
+    }
+    for (cum[0] = 0, a = 1; a <= vocab_size; a++) cum[a] = cum[a - 1] + (kept > 0 ? (keep_prob != NULL ? counts[a - 1] * keep_prob[a] : counts[a - 1]) / kept : 0);
+    fixed += (num_configs + 1) * (vocab_size + 1) * (long long) sizeof(long long); // lookups and the record counts of the dense table
+    fixed += num_threads * (long long) (sizeof(COOCTHREAD) + num_configs * sizeof(TABLEBATCH) + history_size * sizeof(HISTENTRY));
+    if (ids_in_file != NULL) fixed += num_threads * (long long) IDS_BUFFER * sizeof(int);
+    if (ids_out_file != NULL) fixed += num_threads * (long long) IDS_BUFFER * sizeof(int);
+    share = (long long) ((budget - fixed) / num_configs);
+    others = share * (num_configs - 1); // the tables of the other configurations take at most their shares
+    per_thread = share / num_threads;
+    if (per_thread < 1048576) {
+        fprintf(stderr, "-memory %g leaves too little for the tables: %lld bytes are needed besides them.\n", memory_limit, fixed);
+        free(cum);
+        return 1;
+    }
+
+    /* If the whole table fits in each thread's share, there is no band and little overflow; else a sixth of the share
+       goes to the overflow buffer and its sort scratch, and a quarter of the rest to the band table */
+    cells = table_cells(vocab_size * (vocab_size + 1), vocab_size);
+    if (max_product == 0 && band_size < 0 && cells * counter_bytes + 2 * (long long) sizeof(CREC) * (overflow_length > 0 ? overflow_length : MERGE_BUFFER) <= per_thread) {
+        max_product = vocab_size * (vocab_size + 1);
+        band_size = 0;
+        if (overflow_length == 0) overflow_length = MERGE_BUFFER;
+    }
+    if (overflow_length == 0) overflow_length = per_thread / 6 / (2 * (long long) sizeof(CREC));
+    if (overflow_length <= 2 * window_size) overflow_length = 2 * window_size + 1;
+    per_thread -= 2 * (long long) sizeof(CREC) * overflow_length;
+    if (band_size < 0) {
+        for (band_size = 1; band_size * (long long) sizeof(CREC) <= per_thread / 4; band_size *= 2);
+        band_size /= 2;
+    }
+    per_thread -= band_size * (long long) sizeof(CREC);
+    if (max_product == 0 && per_thread < 1048576) {
+        fprintf(stderr, "-memory %g leaves too little for the dense table: the overflow buffer and band table take %.1f MB per thread of %.1f MB.\n",
+                memory_limit, (share / num_threads - per_thread) / 1048576.0, share / num_threads / 1048576.0);
+        free(cum);
+        return 1;
+    }
+    if (max_product == 0) max_product = product_for_cells(per_thread / counter_bytes, 1, vocab_size * (vocab_size + 1), vocab_size) - 1;
+    if (max_product < 1) max_product = 1;
+    cells = table_cells(max_product, vocab_size);
+    /* The band spans 16 times as many pairs as a band table holds: few of the pairs this sparse occur, and those that
+       do not find a slot only go to the overflow array as before */
+    if (band_product == 0) band_product = product_for_cells(cells + 16 * (band_size / 4 * 3), max_product, vocab_size * (vocab_size + 1), vocab_size);
+    merge_memory = share - cells * counter_bytes - (long long) MERGE_BUFFER * sizeof(CREC) * num_threads;
+    if (merge_memory < 0) merge_memory = 0;
+
+    /* Predict: every token kept pairs with window_size tokens before it, one record each, or with (window_size + 1) / 2
+       on average with a dynamic window */
+    pairs = kept * (dynamic_window ? (window_size + 1) / 2.0 : window_size);
+    overflow_records = pairs * miss_fraction(cum, band_size > 0 ? band_product : max_product, vocab_size);
+    runs = (long long) ceil(overflow_records / num_threads / (overflow_length - 2 * window_size)) * num_threads;
+    if (band_size > 0) runs += num_threads;
+    overflow_bytes = (long long) (overflow_records * sizeof(CREC)) + (band_size > 0 ? num_threads * (band_size / 4 * 3) * (long long) sizeof(CREC) : 0);
+    count_peak = fixed + others + num_threads * (cells * counter_bytes + 2 * (long long) sizeof(CREC) * (overflow_length + 1 + TABLE_BATCH) + band_size * (long long) sizeof(CREC));
+    a = (runs + 1) * (long long) MERGE_BUFFER * sizeof(CREC) * (merge_threads > 0 ? merge_threads : num_threads); // read buffers at most
+    merge_peak = fixed + others + cells * counter_bytes + (merge_memory < a ? merge_memory : a) + (long long) MERGE_BUFFER * sizeof(CREC) * num_threads;
+    mirror_peak = symmetric > 0 ? fixed + others + 2 * (long long) sizeof(CREC) * (overflow_length * num_threads + 1) : 0;
+    if (verbose > 1 || dry_run) {
+        fprintf(stderr, "\nMemory plan for %lld words, %lld tokens, within %.2f GB:\n", vocab_size, total, memory_limit);
+        if (num_configs > 1) fprintf(stderr, "  window size %d, %s context, %s, one of %d configurations\n", window_size, symmetric > 0 ? "symmetric" : "asymmetric", distance_weighting ? "weighted by distance" : "unweighted", num_configs);
+        fprintf(stderr, "  vocabulary, lookups and per-thread state: %.1f MB\n", fixed / 1048576.0);
+        fprintf(stderr, "  dense table: max product %lld, %lld cells of %d bytes, %.1f MB per thread\n", max_product, cells, counter_bytes, cells * counter_bytes / 1048576.0);
+        if (band_size > 0) fprintf(stderr, "  band table: band product %lld, %lld slots, %.1f MB per thread\n", band_product, band_size, band_size * sizeof(CREC) / 1048576.0);
+        fprintf(stderr, "  overflow buffer: %lld records, %.1f MB per thread with its sort scratch\n", overflow_length, 2.0 * sizeof(CREC) * overflow_length / 1048576.0);
+        fprintf(stderr, "  predicted: %.3g pairs, %.2f%% past the tables, %lld runs, at most %.1f MB of temporary files\n", pairs, pairs > 0 ? 100 * overflow_records / pairs : 0, runs, overflow_bytes / 1048576.0);
+        fprintf(stderr, "  predicted peak memory: %.1f MB counting, %.1f MB merging", count_peak / 1048576.0, merge_peak / 1048576.0);
+        if (symmetric > 0) fprintf(stderr, ", %.1f MB mirroring", mirror_peak / 1048576.0);
+        fprintf(stderr, "\n");
+    }
+    free(cum);
+    return 0;
+}
+
+/* Build auxiliary lookup table used to index into the dense tables of configuration c */
+long long *make_lookup(COOCCONFIG *c, long long vocab_size) {
+    long long a, id, *lookup = (long long *)calloc( vocab_size + 1, sizeof(long long) );
+    if (lookup == NULL) return NULL;
     lookup[0] = 1;
-    // lookup[a]: lookup[a - 1] + min(max_product/a, vocab_size)
+    // lookup[a]: lookup[a - 1] + min(max_product/a, vocab_size), less the a - 1 columns left of the diagonal if symmetric
     
     // this value is an offset for the row in bigram table from freqrank a
     // bigram table isnt a square matrix, some rows have a non-full length; 
     // lookup keeps an accumulated sum for such lenghts
     // higher max_product, more rare freqrank combinations we will see; more volatile memory needs to be used
     for (a = 1; a <= vocab_size; a++) {
-        if ((lookup[a] = max_product / a) < vocab_size) lookup[a] += lookup[a-1];
-        else lookup[a] = lookup[a-1] + vocab_size;
+        id = (c->max_product / a < vocab_size) ? c->max_product / a : vocab_size; // last column of the row
+        if (c->symmetric > 0) id = (id >= a) ? id - a + 1 : 0;
+        lookup[a] = lookup[a-1] + id;
     }
-    if (verbose > 1) fprintf(stderr, "table contains %lld elements.\n",lookup[a-1]);
-    
+    return lookup;
+}
+
+/* Allocate the tables of one thread for configuration c. Returns 1 on failure, 0 otherwise. */
+int tables_init(COOCTABLES *t, COOCCONFIG *c, long long vocab_size) {
+    memset(t, 0, sizeof(COOCTABLES));
+    t->config = c;
     /* Allocate memory for full array which will store all cooccurrence counts for words whose product of frequency ranks is less than max_product */
-    bigram_table = (real *)calloc( lookup[a-1] , sizeof(real) );
-    if (bigram_table == NULL) {
+    t->bigram_table = calloc( c->lookup[vocab_size] , counter_bytes );
+    // a token's records fit below overflow_length; the batch pending when the threshold was last checked, applied
+    // meanwhile, can add up to TABLE_BATCH UINT_WRAP carries beyond it
+    t->cr = (CREC *) malloc(sizeof(CREC) * (c->overflow_length + 1 + TABLE_BATCH));
+    t->batch = (TABLEBATCH *) malloc(sizeof(TABLEBATCH));
+    if (t->bigram_table == NULL || t->cr == NULL || t->batch == NULL) return 1;
+    t->batch->num = 0;
+    // if symmetric > 0, we can increment ind twice per iteration,
+    // meaning up to 2x window_size in one loop
+    t->threshold = c->symmetric == 0 ? c->overflow_length - c->window_size : c->overflow_length - 2 * c->window_size;
+    if (c->band_size > 0) {
+        t->band.size = c->band_size;
+        for (t->band.shift = 64; c->band_size >> (64 - t->band.shift) > 1; t->band.shift--);
+        t->band.max_count = c->band_size / 4 * 3;
+        if ((t->band.slots = (CREC *) calloc(c->band_size, sizeof(CREC))) == NULL) return 1;
+    }
+    return 0;
+}
+
+/* Free the tables of one thread other than its dense table */
+void tables_free(COOCTABLES *t) {
+    free(t->cr);
+    free(t->buffer);
+    free(t->band.slots);
+    free(t->batch);
+    t->cr = t->buffer = t->band.slots = NULL;
+    t->batch = NULL;
+}
+
+/* Sum the dense tables of the threads for configuration c and merge them with its runs into its output */
+int merge_config(COOCTHREAD *threads, int c, long long vocab_size) {
+    int a, x, status = 0;
+    char filename[MAX_STRING_LENGTH + 20];
+    FILE *fid, *out = stdout;
+    REDUCETASK *reducers;
+    pthread_t *pt, compactor;
+    long long *lookup = configs[c].lookup;
+
+    config_use(&configs[c]);
+    if (num_configs > 1 && verbose > 1) fprintf(stderr, "Writing configuration %d to %s...\n", c + 1, configs[c].output);
+    if (num_threads > 1) {
+        // Reduce the per-thread dense tables into that of thread 0
+        reducers = (REDUCETASK *) malloc(num_threads * sizeof(REDUCETASK));
+        pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+        for (a = 0; a < num_threads; a++) {
+            reducers[a].threads = threads;
+            reducers[a].config = c;
+            reducers[a].lookup = lookup;
+            reducers[a].carry = NULL;
+            reducers[a].num_carry = reducers[a].max_carry = 0;
+            reducers[a].start = lookup[vocab_size] / num_threads * a;
+            reducers[a].end = (a == num_threads - 1) ? lookup[vocab_size] : lookup[vocab_size] / num_threads * (a + 1);
+            pthread_create(&pt[a], NULL, reduce_thread, (void *)&reducers[a]);
+        }
+        for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+        for (a = 0; a < num_threads; a++) {
+            status |= reducers[a].status;
+            if (status == 0 && reducers[a].num_carry > 0) status = write_overflow(reducers[a].carry, NULL, reducers[a].num_carry, c);
+            free(reducers[a].carry);
+        }
+        free(reducers);
+        free(pt);
+        for (a = 1; a < num_threads; a++) {
+            free(threads[a].tables[c].bigram_table);
+            threads[a].tables[c].bigram_table = NULL;
+        }
+        if (status != 0) return 1;
+    }
+    
+    /* The merge reads the dense table in place, skipping zeros, as file 0 */
+    if (verbose > 1) fprintf(stderr, "Counting nonzero cells of the dense table...");
+    if (dense_open(threads[0].tables[c].bigram_table, lookup, vocab_size) != 0) {
         fprintf(stderr, "Couldn't allocate memory!");
-        free_resources(vocab_hash, cr, lookup, bigram_table);
+        free(dense.records);
         return 1;
     }
+    // The dense table and lookup are the merge's now, see dense_close
+    threads[0].tables[c].bigram_table = NULL;
+    configs[c].lookup = NULL;
+    if (verbose > 1) fprintf(stderr,"%lld records; %d files in total.\n", dense.records[vocab_size], num_runs + 1);
+    if (configs[c].output != NULL && output_ranges == NULL && (out = fopen(configs[c].output, "wb")) == NULL) {
+        dense_close();
+        return log_file_loading_error("output file", configs[c].output);
+    }
     
-    fid = stdin;
-    // sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-    sprintf(filename,"%s_%04d.bin", file_head, fidcounter);
-    foverflow = fopen(filename,"wb");
-    if (verbose > 1) fprintf(stderr,"Processing token: 0");
+    /* Merge the dense table and the runs left, in the order they were written */
+    if (symmetric == 0) {
+        status = merge_runs(0, c, out, configs[c].output != NULL && output_ranges != NULL ? configs[c].output : output_ranges);
+        dense_close();
+    }
+    else {
+        // Only pairs with word1 <= word2 were counted: merge them into one more temporary file, add their mirror
+        // images as runs, and merge the two halves
+        x = ++fidcounter;
+        sprintf(filename,"%s_%04d.bin",file_head,x);
+        if ((fid = fopen(filename, "wb")) == NULL) status = log_file_loading_error("temp file", filename);
+        else {
+            status = merge_runs(0, c, fid, NULL);
+            fclose(fid);
+        }
+        dense_close();
+        if (status == 0) {
+            if (verbose > 1) fprintf(stderr, "Mirroring cooccurrences...");
+            compact_start(&compactor);
+            status = mirror_runs(x, c);
+            status |= compact_finish(compactor);
+            if (verbose > 1) fprintf(stderr, "%d files in total.\n", num_runs + 1);
+        }
+        if (status == 0) status = merge_runs(x, c, out, configs[c].output != NULL && output_ranges != NULL ? configs[c].output : output_ranges);
+    }
+    if (out != stdout) fclose(out);
+    return status;
+}
 
-    // if symmetric > 0, we can increment ind twice per iteration,
-    // meaning up to 2x window_size in one loop
-    int overflow_threshold = symmetric == 0 ? overflow_length - window_size : overflow_length - 2 * window_size;
+/* Collect word-word cooccurrence counts from input stream */
+int get_cooccurrence() {
+    int x, c, status = 0;
+    long long a, j = 0, id, counter = 0, vocab_size, *counts = NULL, fixed;
+    char format[20], str[MAX_STRING_LENGTH + 1];
+    unsigned long long fingerprint = 0;
+    FILE *fid;
+    CORPUSREADER corpus;
+    HASHTABLE *vocab_hash = NULL;
+    COOCTHREAD *threads;
+    CHECKPOINTTASK checkpointer;
+    pthread_t *pt, compactor, checkpoint_pt;
     
-    /* For each token in input stream, calculate a weighted cooccurrence sum within window_size */
-    while (1) {
-        if (ind >= overflow_threshold) {
-            // If overflow buffer is (almost) full, sort it and write it to temporary file
-            qsort(cr, ind, sizeof(CREC), compare_crec);
-            write_chunk(cr,ind,foverflow);
-            fclose(foverflow);
-            fidcounter++;
-            sprintf(filename,"%s_%04d.bin",file_head,fidcounter);
-            foverflow = fopen(filename,"wb");
-            ind = 0;
-        }
-        flag = get_word(str, fid);
-        if (verbose > 2) fprintf(stderr, "Maybe processing token: %s\n", str);
-        if (flag == 1) {
-            // Newline, reset line index (j); maybe eof.
-            if (feof(fid)) {
-                if (verbose > 2) fprintf(stderr, "Not getting coocurs as at eof\n");
-                break;
-            }
-            j = 0;
-            if (verbose > 2) fprintf(stderr, "Not getting coocurs as at newline\n");
-            continue;
+    fprintf(stderr, "COUNTING COOCCURRENCES\n");
+    if (verbose > 0) {
+        for (c = 0; c < num_configs; c++) {
+            if (num_configs > 1) fprintf(stderr, "configuration %d, to %s:\n", c + 1, configs[c].output);
+            fprintf(stderr, "window size: %d\n", configs[c].window_size);
+            if (configs[c].symmetric == 0) fprintf(stderr, "context: asymmetric\n");
+            else fprintf(stderr, "context: symmetric\n");
+            if (num_configs > 1 && configs[c].distance_weighting == 0) fprintf(stderr, "not weighted by distance\n");
         }
-        counter++;
-        count_context(str, sub_str, j, history, lookup, cr, &ind, bigram_table, vocab_hash);
-        if ((counter%100000) == 0){
-            if (verbose > 1) fprintf(stderr,"\033[19G%lld",counter);
+        if (dynamic_window) fprintf(stderr, "dynamic window\n");
+        if (subsample > 0) fprintf(stderr, "subsample: %g\n", subsample);
+        if (subsample > 0 || dynamic_window) fprintf(stderr, "seed: %llu\n", seed);
+    }
+    sprintf(format,"%%%ds %%lld", MAX_STRING_LENGTH); // Format to read from vocab file, which has the counts for plan_memory and subsample
+    if (verbose > 1) fprintf(stderr, "Reading vocab from file \"%s\"...", vocab_file);
+    if ((x = bvocab_open(&bvocab, vocab_file)) == 0) j = bvocab.size; // binary vocab: mapped, nothing to parse
+    else if (x == 1 && (vocab_hash = hashtable_create(TSIZE)) != NULL && (fid = fopen(vocab_file,"r")) != NULL) {
+        while (fscanf(fid, format, str, &id) != EOF){
+            // Here id is the count, kept for plan_memory: inserting vocab words into hash table with their frequency rank, j
+            // vocab_file is a list of (word, count) entries, sorted non-ascending by count
+            if (j % ARRAY_SIZE_INCREMENT == 0) counts = (long long *) realloc(counts, sizeof(long long) * (j + ARRAY_SIZE_INCREMENT));
+            counts[j] = id;
+            hashinsert(vocab_hash, str, ++j); 
         }
-        j++;
+        fclose(fid);
+    }
+    else { 
+        log_file_loading_error("vocab file", vocab_file);
+        free_resources(vocab_hash);
+        return 1;
+    }
+    vocab_size = j;
+    j = 0;
+    if (verbose > 1) fprintf(stderr, "loaded %lld words.\n", vocab_size);
+    if (load_phrases(vocab_hash, vocab_size) != 0) {
+        free(counts);
+        free_resources(vocab_hash);
+        return 1;
+    }
+    fixed = (vocab_hash != NULL ? vocab_hash->size * (long long) sizeof(HASHENTRY) + vocab_hash->words.capacity : bvocab.bytes)
+        + (vocab_size + 2) * (long long) sizeof(long long) + phrase_start[vocab_size + 1] * (long long) sizeof(int);
+    x = subsample > 0 ? subsample_init(bvocab.data != NULL ? bvocab.counts : counts, vocab_size) : 0;
+    for (c = 0; x == 0 && c < num_configs; c++) {
+        config_use(&configs[c]);
+        x = plan_memory(bvocab.data != NULL ? bvocab.counts : counts, vocab_size, fixed);
+        config_store(&configs[c]);
+    }
+    free(counts);
+    if (x != 0 || dry_run) {
+        free_resources(vocab_hash);
+        return x;
+    }
+    for (c = 0; c < num_configs; c++) {
+        if (verbose > 1 && num_configs > 1) fprintf(stderr, "configuration %d:\n", c + 1);
+        if (verbose > 1) fprintf(stderr, "max product: %lld\n", configs[c].max_product);
+        if (verbose > 1 && configs[c].band_size > 0) fprintf(stderr, "band product: %lld\nband table size: %lld\n", configs[c].band_product, configs[c].band_size);
+        if (verbose > 1) fprintf(stderr, "overflow length: %lld\n", configs[c].overflow_length);
+        if (verbose > 1) fprintf(stderr, "Building lookup table...");
+        if ((configs[c].lookup = make_lookup(&configs[c], vocab_size)) == NULL) status = 1;
+        if (status != 0) break;
+        if (verbose > 1) fprintf(stderr, "table contains %lld elements.\n", configs[c].lookup[vocab_size]);
     }
     
-    /* Write out temp buffer for the final time (it may not be full) */
-    if (verbose > 1) fprintf(stderr,"\033[0GProcessed %lld tokens.\n",counter);
-    qsort(cr, ind, sizeof(CREC), compare_crec);
-    write_chunk(cr,ind,foverflow);
-    sprintf(filename,"%s_0000.bin",file_head);
-    
-    /* Write out full bigram_table, skipping zeros */
-    if (verbose > 1) fprintf(stderr, "Writing cooccurrences to disk");
-    fid = fopen(filename,"wb");
-    j = 1e6;
-    for (x = 1; x <= vocab_size; x++) {
-        if ( (long long) (0.75*log(vocab_size / x)) < j) {
-            j = (long long) (0.75*log(vocab_size / x));
-            if (verbose > 1) fprintf(stderr,".");
-        } // log's to make it look (sort of) pretty
-        for (y = 1; y <= (lookup[x] - lookup[x-1]); y++) { //(lookup[x] - lookup[x-1]) size of xth row
-            if ((r = bigram_table[lookup[x-1] - 2 + y]) != 0) {
-                fwrite(&x, sizeof(int), 1, fid);
-                fwrite(&y, sizeof(int), 1, fid);
-                fwrite(&r, sizeof(real), 1, fid);
-            }
+    memset(&corpus, 0, sizeof(CORPUSREADER));
+    if (status != 0) fprintf(stderr, "Couldn't allocate memory!");
+    else if (ids_in_file == NULL && corpus_open(&corpus, corpus_file) != 0) status = log_file_loading_error("corpus", corpus_file == NULL ? "stdin" : corpus_file);
+    if (status != 0) {
+        for (c = 0; c < num_configs; c++) free(configs[c].lookup);
+        free_resources(vocab_hash);
+        return 1;
+    }
+    checkpointing = checkpoint_minutes > 0 || resume;
+    if (ids_in_file != NULL || ids_out_file != NULL || checkpointing) fingerprint = vocab_fingerprint(vocab_hash, vocab_size);
+    threads = (COOCTHREAD *) calloc(num_threads, sizeof(COOCTHREAD));
+    pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    for (a = 0; a < num_threads; a++) {
+        threads[a].vocab_hash = vocab_hash;
+        threads[a].vocab_size = vocab_size;
+        // Each thread counts into its own tables; those of thread 0 become the main ones
+        if ((threads[a].tables = (COOCTABLES *) calloc(num_configs, sizeof(COOCTABLES))) == NULL) status = 1;
+        for (c = 0; c < num_configs && status == 0; c++) status = tables_init(&threads[a].tables[c], &configs[c], vocab_size);
+    }
+    if (status != 0) fprintf(stderr, "Couldn't allocate memory!");
+    else status = open_ranges(threads, &corpus, fingerprint);
+    if (status == 0 && resume) status = checkpoint_load(threads, fingerprint);
+    if (status == 0) {
+        if (verbose > 1) {
+            if (num_threads > 1) fprintf(stderr, "Counting with %d threads...", num_threads);
+            else fprintf(stderr,"Processing token: 0");
+        }
+        compact_start(&compactor);
+        checkpointer.threads = threads;
+        checkpointer.fingerprint = fingerprint;
+        if (checkpoint_minutes > 0) pthread_create(&checkpoint_pt, NULL, checkpoint_thread, (void *)&checkpointer);
+        if (num_threads == 1) count_thread((void *)&threads[0]);
+        else {
+            for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, count_thread, (void *)&threads[a]);
+            for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+        }
+        if (checkpoint_minutes > 0) {
+            pthread_mutex_lock(&fidcounter_lock);
+            counting_done = 1;
+            pthread_cond_broadcast(&checkpoint_cond);
+            pthread_mutex_unlock(&fidcounter_lock);
+            pthread_join(checkpoint_pt, NULL);
+        }
+        status |= compact_finish(compactor);
+        for (a = 0; a < num_threads; a++) {
+            status |= threads[a].status;
+            counter += threads[a].tokens;
+            j += threads[a].dropped;
         }
     }
-    
-    if (verbose > 1) fprintf(stderr,"%d files in total.\n",fidcounter + 1);
+    status |= close_ranges(threads);
+    if (ids_in_file == NULL) corpus_close(&corpus);
+    free(pt);
+    for (a = 0; a < num_threads; a++) {
+        for (c = 0; threads[a].tables != NULL && c < num_configs; c++) tables_free(&threads[a].tables[c]);
+    }
+    if (status == 0) {
+        if (verbose > 1) fprintf(stderr,"\033[0GProcessed %lld tokens.\n",counter);
+        if (verbose > 1 && subsample > 0) fprintf(stderr, "Subsampled away %lld tokens (%.1f%%).\n", j, counter > 0 ? 100.0 * j / counter : 0);
+        // The counting is done: the checkpoint and the files merged since it are no longer needed
+        if (checkpointing) {
+            sprintf(str, "%s_checkpoint.bin", file_head);
+            remove(str);
+            remove_retired();
+            checkpointing = 0;
+        }
+    }
+    else if (checkpointing && verbose > 0) fprintf(stderr, "The last checkpoint, if any, and its files are kept for -resume.\n");
+    free_resources(vocab_hash);
+    for (c = 0; status == 0 && c < num_configs; c++) status = merge_config(threads, c, vocab_size);
+    for (c = 0; c < num_configs; c++) free(configs[c].lookup); // those not handed to a merge
+    for (a = 0; a < num_threads; a++) {
+        for (c = 0; threads[a].tables != NULL && c < num_configs; c++) free(threads[a].tables[c].bigram_table);
+        free(threads[a].tables);
+    }
+    free(threads);
+    free(runs);
+    free(retired);
+    return status;
+}
+
+/* Add a configuration with the settings given, and the sizes of the command line, writing to output (NULL: stdout).
+   Returns 1 on failure, 0 otherwise. */
+int add_config(int window, int sym, int weighting, char *output) {
+    COOCCONFIG *tmp = (COOCCONFIG *) realloc(configs, sizeof(COOCCONFIG) * (num_configs + 1)), *c;
+    if (tmp == NULL) return 1;
+    configs = tmp;
+    c = &configs[num_configs++];
+    memset(c, 0, sizeof(COOCCONFIG));
+    c->window_size = window;
+    c->symmetric = sym;
+    c->distance_weighting = weighting;
+    c->counter_type = counter_bytes == 4 ? (weighting ? COUNTER_FLOAT : COUNTER_UINT) : COUNTER_REAL;
+    c->max_product = max_product;
+    c->band_product = band_product;
+    c->band_size = band_size;
+    c->overflow_length = overflow_length;
+    if (output != NULL && (c->output = strdup(output)) == NULL) return 1;
+    if (window > history_size) history_size = window;
+    return 0;
+}
+
+/* Set up the configurations to count: those listed in configs_file, one per line as <window-size> <symmetric>
+   <distance-weighting> <output file>, or else the one of the command line. Returns 1 on failure, 0 otherwise. */
+int read_configs() {
+    int window, sym, weighting, n;
+    char format[20], output[MAX_STRING_LENGTH + 1];
+    FILE *fid;
+
+    num_configs = 0;
+    history_size = 1;
+    if (configs_file == NULL) {
+        if (window_size < 1) window_size = 1;
+        return add_config(window_size, symmetric, distance_weighting, NULL);
+    }
+    if ((fid = fopen(configs_file, "r")) == NULL) return log_file_loading_error("configs file", configs_file);
+    sprintf(format, "%%d %%d %%d %%%ds", MAX_STRING_LENGTH);
+    while ((n = fscanf(fid, format, &window, &sym, &weighting, output)) == 4) {
+        if (window < 1 || add_config(window, sym, weighting, output) != 0) break;
+    }
     fclose(fid);
-    fclose(foverflow);
-    free_resources(vocab_hash, cr, lookup, bigram_table);
-    return merge_files(fidcounter + 1); // Merge the sorted temporary files
+    if (n != EOF || num_configs == 0) {
+        fprintf(stderr, "Configs file \"%s\" needs lines of <window-size> <symmetric> <distance-weighting> <output file>.\n", configs_file);
+        return 1;
+    }
+    return 0;
 }
 
 int main(int argc, char **argv) {
     int i;
-    real rlimit, n = 1e5;
     vocab_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
     file_head = malloc(sizeof(char) * MAX_STRING_LENGTH);
     
@@ -463,21 +2211,60 @@ int main(int argc, char **argv) {
         printf("\t\tIf <int> = 0, only use left context; if <int> = 1 (default), use left and right\n");
         printf("\t-window-size <int>\n");
         printf("\t\tNumber of context words to the left (and to the right, if symmetric = 1); default 15\n");
+        printf("\t-dynamic-window <int>\n");
+        printf("\t\tIf <int> = 1, count the context of each word only to a distance drawn uniformly from 1 .. window-size, as word2vec does; default 0\n");
+        printf("\t-subsample <float>\n");
+        printf("\t\tDrop each token of a word that makes up a share f of the corpus (by the counts in the vocab file) above <float>, with\n\t\tprobability 1 - (sqrt(f / <float>) + 1) * <float> / f, before counting, as word2vec does; typically 1e-3 to 1e-5; default 0 (off)\n");
+        printf("\t-seed <int>\n");
+        printf("\t\tSeed of the random draws of -subsample and -dynamic-window; default 1. Each draw depends only on the seed and the\n\t\tposition of the token in the input, so the output is the same for any number of threads\n");
+        printf("\t-configs <file>\n");
+        printf("\t\tCount several matrices in one pass over the corpus, one for each line of <file>: <window-size> <symmetric>\n\t\t<distance-weighting> <output file>. These override the options of the same names; each matrix gets its own\n\t\ttables, an equal share of -memory, and its own output file, or prefix of range files with -output-ranges\n");
         printf("\t-vocab-file <file>\n");
-        printf("\t\tFile containing vocabulary (truncated unigram counts, produced by 'vocab_count'); default vocab.txt\n");
+        printf("\t\tFile containing vocabulary (truncated unigram counts, produced by 'vocab_count', as text or with -binary-vocab); default vocab.txt\n");
+        printf("\t-phrase-file <file>\n");
+        printf("\t\tPhrase index written by 'vocab_count -phrase-file' together with the vocabulary; default: split the phrases in the vocabulary on loading\n");
+        printf("\t-corpus-file <file>\n");
+        printf("\t\tRead the corpus from <file> instead of stdin\n");
+        printf("\t-threads <int>\n");
+        printf("\t\tNumber of threads; default 1. The corpus is split into line-aligned ranges counted in parallel, so it must be a file\n\t\t(-corpus-file, redirected stdin or -ids-in), not a pipe. Each thread gets its share of -memory for its own tables\n");
+        printf("\t-merge-threads <int>\n");
+        printf("\t\tNumber of threads merging the temporary files, each over its own range of word1; default: -threads. Without\n\t\t-output-ranges, the ranges go to temporary files that are then appended to the output in order\n");
+        printf("\t-output-ranges <prefix>\n");
+        printf("\t\tWrite the merged records of each range to its own file, <prefix>_0000.bin, <prefix>_0001.bin, ..., instead of to stdout\n");
+        printf("\t-ids-out <file>\n");
+        printf("\t\tAlso write the corpus, encoded as vocabulary ranks, to <file>, for later runs with the same vocabulary to read with -ids-in\n");
+        printf("\t-ids-in <file>\n");
+        printf("\t\tRead the corpus encoded by an earlier run with -ids-out from <file> instead of tokenizing stdin\n");
         printf("\t-memory <float>\n");
-        printf("\t\tSoft limit for memory consumption, in GB -- based on simple heuristic, so not extremely accurate; default 4.0\n");
+        printf("\t\tSoft limit for memory consumption, in GB; default 3.0. The tables, buffers and merge are sized to it from the counts in\n\t\tthe vocabulary file\n");
         printf("\t-max-product <int>\n");
         printf("\t\tLimit the size of dense cooccurrence array by specifying the max product <int> of the frequency counts of the two cooccurring words.\n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n");
+        printf("\t-band-product <int>\n");
+        printf("\t\tCount the pairs with a product of frequency ranks below <int>, but not in the dense array, in a hash table of each thread\n\t\tinstead of the overflow array, as long as it has room. This value overrides that which is automatically produced by '-memory'.\n");
+        printf("\t-band-size <int>\n");
+        printf("\t\tNumber of slots in each thread's hash table for the band of '-band-product', rounded down to a power of two; 0 for no\n\t\thash table. This value overrides that which is automatically produced by '-memory'.\n");
+        printf("\t-counter-bytes <int>\n");
+        printf("\t\tBytes per count in the dense cooccurrence array: 8 (default) for doubles, or 4 for floats, or for exact unsigned ints\n\t\twith -distance-weighting 0. With 4, '-memory' affords about twice the max product\n");
         printf("\t-overflow-length <int>\n");
         printf("\t\tLimit to length <int> the sparse overflow array, which buffers cooccurrence data that does not fit in the dense array, before writing to disk. \n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n");
+        printf("\t-compact-runs <int>\n");
+        printf("\t\tWhile counting, merge every <int> temporary files of the same generation into one in the background, summing duplicates,\n\t\tto bound the number of temporary files and the disk they take; 0 or 1 to merge them all only at the end; default 16\n");
+        printf("\t-checkpoint <float>\n");
+        printf("\t\tEvery <float> minutes, pause the counting at the start of a line and write a checkpoint, <overflow-file>_checkpoint.bin,\n\t\tof the dense tables, the positions reached in the input and the temporary files written; default 0 (never)\n");
+        printf("\t-resume <int>\n");
+        printf("\t\tIf <int> = 1, continue the counting from the last checkpoint of a run with the same options and input, instead of\n\t\tstarting over; default 0. The checkpoint goes once the counting is done: an interrupted merge starts over\n");
+        printf("\t-dry-run <int>\n");
+        printf("\t\tIf <int> = 1, load the vocabulary, print the memory plan with its predicted peak memory, temporary disk and number\n\t\tof temporary files, and exit without counting; default 0\n");
         printf("\t-overflow-file <file>\n");
         printf("\t\tFilename, excluding extension, for temporary files; default overflow\n");
         printf("\t-distance-weighting <int>\n");
         printf("\t\tIf <int> = 0, do not weight cooccurrence count by distance between words; if <int> = 1 (default), weight the cooccurrence count by inverse of distance between words\n");
 
         printf("\nExample usage:\n");
-        printf("./cooccur -verbose 2 -symmetric 0 -window-size 10 -vocab-file vocab.txt -memory 8.0 -overflow-file tempoverflow < corpus.txt > cooccurrences.bin\n\n");
+        printf("./cooccur -verbose 2 -symmetric 0 -window-size 10 -vocab-file vocab.txt -memory 8.0 -overflow-file tempoverflow < corpus.txt > cooccurrences.bin\n");
+        printf("./cooccur -window-size 10 -vocab-file vocab.txt -ids-out corpus.ids < corpus.txt > cooccurrences.bin\n");
+        printf("./cooccur -window-size 5 -distance-weighting 0 -vocab-file vocab.txt -ids-in corpus.ids > cooccurrences.w5.bin\n");
+        printf("./cooccur -vocab-file vocab.txt -configs sweep.txt -corpus-file corpus.txt -threads 8\n\n");
         free(vocab_file);
         free(file_head);
         return 0;
@@ -486,25 +2273,53 @@ int main(int argc, char **argv) {
     if ((i = find_arg((char *)"-verbose", argc, argv)) > 0) verbose = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-symmetric", argc, argv)) > 0) symmetric = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-window-size", argc, argv)) > 0) window_size = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-dynamic-window", argc, argv)) > 0) dynamic_window = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-subsample", argc, argv)) > 0) subsample = atof(argv[i + 1]);
+    if ((i = find_arg((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
     if ((i = find_arg((char *)"-vocab-file", argc, argv)) > 0) strcpy(vocab_file, argv[i + 1]);
     else strcpy(vocab_file, (char *)"vocab.txt");
     if ((i = find_arg((char *)"-overflow-file", argc, argv)) > 0) strcpy(file_head, argv[i + 1]);
     else strcpy(file_head, (char *)"overflow");
+    if ((i = find_arg((char *)"-phrase-file", argc, argv)) > 0) phrase_file = argv[i + 1];
+    if ((i = find_arg((char *)"-corpus-file", argc, argv)) > 0) corpus_file = argv[i + 1];
+    if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+    if (num_threads < 1) num_threads = 1;
+    if ((i = find_arg((char *)"-merge-threads", argc, argv)) > 0) merge_threads = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-output-ranges", argc, argv)) > 0) output_ranges = argv[i + 1];
+    if ((i = find_arg((char *)"-compact-runs", argc, argv)) > 0) compact_runs = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-ids-in", argc, argv)) > 0) ids_in_file = argv[i + 1];
+    if ((i = find_arg((char *)"-ids-out", argc, argv)) > 0) ids_out_file = argv[i + 1];
     if ((i = find_arg((char *)"-memory", argc, argv)) > 0) memory_limit = atof(argv[i + 1]);
     if ((i = find_arg((char *)"-distance-weighting", argc, argv)) > 0)  distance_weighting = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-counter-bytes", argc, argv)) > 0 && atoi(argv[i + 1]) == 4) counter_bytes = 4;
+    if ((i = find_arg((char *)"-configs", argc, argv)) > 0) configs_file = argv[i + 1];
     
-    /* The memory_limit determines a limit on the number of elements in bigram_table and the overflow buffer */
-    /* Estimate the maximum value that max_product can take so that this limit is still satisfied */
-    rlimit = 0.85 * (real)memory_limit * 1073741824/(sizeof(CREC));
-    while (fabs(rlimit - n * (log(n) + 0.1544313298)) > 1e-3) n = rlimit / (log(n) + 0.1544313298);
-    max_product = (long long) n;
-    overflow_length = (long long) rlimit/6; // 0.85 + 1/6 ~= 1
-    
-    /* Override estimates by specifying limits explicitly on the command line */
+    /* Limits given on the command line; plan_memory sizes the rest to memory_limit once the vocabulary is known */
     if ((i = find_arg((char *)"-max-product", argc, argv)) > 0) max_product = atoll(argv[i + 1]);
     if ((i = find_arg((char *)"-overflow-length", argc, argv)) > 0) overflow_length = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-band-size", argc, argv)) > 0) {
+        for (band_size = 1; band_size <= atoll(argv[i + 1]); band_size *= 2);
+        band_size = band_size < 4 ? 0 : band_size / 2;
+    }
+    if ((i = find_arg((char *)"-band-product", argc, argv)) > 0) band_product = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-dry-run", argc, argv)) > 0) dry_run = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-checkpoint", argc, argv)) > 0) checkpoint_minutes = atof(argv[i + 1]);
+    if ((i = find_arg((char *)"-resume", argc, argv)) > 0) resume = atoi(argv[i + 1]);
+    if (ids_out_file != NULL && (checkpoint_minutes > 0 || resume)) {
+        fprintf(stderr, "Error, -checkpoint and -resume can't be used with -ids-out.\n");
+        free(vocab_file);
+        free(file_head);
+        return 1;
+    }
     
+    if (read_configs() != 0) {
+        free(vocab_file);
+        free(file_head);
+        return 1;
+    }
     const int returned_value = get_cooccurrence();
+    for (i = 0; i < num_configs; i++) free(configs[i].output);
+    free(configs);
     free(vocab_file);
     free(file_head);
     return returned_value;
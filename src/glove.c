@@ -59,6 +59,7 @@ real grad_clip_value = 100.0; // Clipping parameter for gradient components. Val
 real *W, *gradsq, *cost;
 long long num_lines, *lines_per_thread, vocab_size;
 char vocab_file[MAX_STRING_LENGTH];
+BINVOCAB bvocab; // mapped vocabulary, if vocab_file is binary
 char input_file[MAX_STRING_LENGTH];
 char save_W_file[MAX_STRING_LENGTH];
 char save_gradsq_file[MAX_STRING_LENGTH];
@@ -297,14 +298,15 @@ int save_params(int nb_iter) {
         }
         fout = fopen(output_file,"wb");
         if (fout == NULL) {log_file_loading_error("weights file", save_W_file); free(word); return 1;}
-        fid = fopen(vocab_file, "r");
+        fid = (bvocab.data == NULL) ? fopen(vocab_file, "r") : NULL; // a binary vocab is already mapped
         sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-        if (fid == NULL) {log_file_loading_error("vocab file", vocab_file); free(word); fclose(fout); return 1;}
+        if (fid == NULL && bvocab.data == NULL) {log_file_loading_error("vocab file", vocab_file); free(word); fclose(fout); return 1;}
         if (write_header) fprintf(fout, "%lld %d\n", vocab_size, vector_size);
         for (a = 0; a < vocab_size; a++) {
-            if (fscanf(fid,format,word) == 0) {free(word); fclose(fid); fclose(fout); return 1;}
+            if (bvocab.data != NULL) strcpy(word, BVOCAB_WORD(&bvocab, a + 1));
+            else if (fscanf(fid,format,word) == 0) {free(word); fclose(fid); fclose(fout); return 1;}
             // input vocab cannot contain special <unk> keyword
-            if (strcmp(word, "<unk>") == 0) {free(word); fclose(fid); fclose(fout);  return 1;}
+            if (strcmp(word, "<unk>") == 0) {free(word); if (fid != NULL) fclose(fid); fclose(fout); return 1;}
             fprintf(fout, "%s",word);
             if (model == 0) { // Save all parameters (including bias)
                 for (b = 0; b < (vector_size + 1); b++) fprintf(fout," %lf", W[a * (vector_size + 1) + b]);
@@ -321,7 +323,7 @@ int save_params(int nb_iter) {
                 for (b = 0; b < (vector_size + 1); b++) fprintf(fgs," %lf", gradsq[(vocab_size + a) * (vector_size + 1) + b]);
                 fprintf(fgs,"\n");
             }
-            if (fscanf(fid,format,word) == 0) {
+            if (fid != NULL && fscanf(fid,format,word) == 0) {
                 // Eat irrelevant frequency entry
                 fclose(fout);
                 fclose(fid);
@@ -359,7 +361,7 @@ int save_params(int nb_iter) {
             free(unk_context);
         }
 
-        fclose(fid);
+        if (fid != NULL) fclose(fid);
         fclose(fout);
         if (save_gradsq > 0) fclose(fgs);
     }
@@ -474,7 +476,7 @@ int main(int argc, char **argv) {
         printf("\t-input-file <file>\n");
         printf("\t\tBinary input file of shuffled cooccurrence data (produced by 'cooccur' and 'shuffle'); default cooccurrence.shuf.bin\n");
         printf("\t-vocab-file <file>\n");
-        printf("\t\tFile containing vocabulary (truncated unigram counts, produced by 'vocab_count'); default vocab.txt\n");
+        printf("\t\tFile containing vocabulary (truncated unigram counts, produced by 'vocab_count', as text or with -binary-vocab); default vocab.txt\n");
         printf("\t-save-file <file>\n");
         printf("\t\tFilename, excluding extension, for word vector output; default vectors\n");
         printf("\t-gradsq-file <file>\n");
@@ -535,13 +537,16 @@ int main(int argc, char **argv) {
         if ((i = find_arg((char *)"-seed", argc, argv)) > 0) seed = atoi(argv[i + 1]);
         
         vocab_size = 0;
-        fid = fopen(vocab_file, "r");
-        if (fid == NULL) {log_file_loading_error("vocab file", vocab_file); free(cost); return 1;}
-        while ((i = getc(fid)) != EOF) if (i == '\n') vocab_size++; // Count number of entries in vocab_file
-        fclose(fid);
+        if ((i = bvocab_open(&bvocab, vocab_file)) == 0) vocab_size = bvocab.size; // binary vocab: size is in the header
+        else if (i == 1 && (fid = fopen(vocab_file, "r")) != NULL) {
+            while ((i = getc(fid)) != EOF) if (i == '\n') vocab_size++; // Count number of entries in vocab_file
+            fclose(fid);
+        }
+        else {log_file_loading_error("vocab file", vocab_file); free(cost); return 1;}
         if (vocab_size == 0) {fprintf(stderr, "Unable to find any vocab entries in vocab file %s.\n", vocab_file); free(cost); return 1;}
         result = train_glove();
         free(cost);
+        bvocab_close(&bvocab);
     }
     free(W);
     free(gradsq);
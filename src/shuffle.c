@@ -67,21 +67,24 @@ void shuffle(CREC *array, long n) {
 
 /* Merge shuffled temporary files; doesn't necessarily produce a perfect shuffle, but good enough */
 int shuffle_merge(int num) {
-    long i, j, k, l = 0;
+    long i, j, l = 0;
     int fidcounter = 0;
     CREC *array;
     char filename[MAX_STRING_LENGTH];
-    FILE **fid, *fout = stdout;
+    CRECREADER *sources;
+    FILE *fout = stdout;
+    long long block = array_size / num / 32; // the readers' blocks take at most 1/32 of the memory of array between them
     
+    if (block > 65536) block = 65536;
     array = malloc(sizeof(CREC) * array_size);
-    fid = calloc(num, sizeof(FILE));
+    sources = malloc(sizeof(CRECREADER) * num);
     for (fidcounter = 0; fidcounter < num; fidcounter++) { //num = number of temporary files to merge
         sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
-        fid[fidcounter] = fopen(filename, "rb");
-        if (fid[fidcounter] == NULL) {
+        if (crec_reader_open(&sources[fidcounter], filename, block) != 0) {
             log_file_loading_error("temp file", filename);
+            while (--fidcounter >= 0) crec_reader_close(&sources[fidcounter]);
             free(array);
-            free_fid(fid, num);
+            free(sources);
             return 1;
         }
     }
@@ -90,14 +93,7 @@ int shuffle_merge(int num) {
     while (1) { //Loop until EOF in all files
         i = 0;
         //Read at most array_size values into array, roughly array_size/num from each temp file
-        for (j = 0; j < num; j++) {
-            if (feof(fid[j])) continue;
-            for (k = 0; k < array_size / num; k++){
-                fread(&array[i], sizeof(CREC), 1, fid[j]);
-                if (feof(fid[j])) break;
-                i++;
-            }
-        }
+        for (j = 0; j < num; j++) i += crec_reader_read(&sources[j], &array[i], array_size / num);
         if (i == 0) break;
         l += i;
         shuffle(array, i-1); // Shuffles lines between temp files
@@ -106,13 +102,13 @@ int shuffle_merge(int num) {
     }
     fprintf(stderr, "\033[0GMerging temp files: processed %ld lines.", l);
     for (fidcounter = 0; fidcounter < num; fidcounter++) {
-        fclose(fid[fidcounter]);
+        crec_reader_close(&sources[fidcounter]);
         sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
         remove(filename);
     }
     fprintf(stderr, "\n\n");
     free(array);
-    free(fid);
+    free(sources);
     return 0;
 }
 
@@ -27,16 +27,86 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+
+// windows pthread.h is buggy, but this #define fixes it
+#define HAVE_STRUCT_TIMESPEC
+#include <pthread.h>
+
 #include "common.h"
 
+#define _FILE_OFFSET_BITS 64
+#define MAX_MERGE_RUNS 256 // most runs merged at once; more are first merged into intermediate runs
+
 typedef struct vocabulary {
     char *word;
     long long count;
+    unsigned long long tie; // pseudo-random tie-breaker used when truncating, see CompareVocab
+    long long error; // maximum overestimation of count (approximate mode only)
+    long long offset; // of word in the arena, while merging runs; see merge_runs
 } VOCAB;
 
+/* One counter of the SpaceSaving summary used by -approx */
+typedef struct counter {
+    char *word; // null-terminated; replaced when the counter is reassigned
+    int alloc; // bytes allocated for word
+    unsigned long long hash;
+    long long count; // upper bound on the number of occurrences of word
+    long long error; // count - error is a lower bound on the number of occurrences
+    long long heap; // position in SPACESAVING.heap
+    int standalone; // word occurred as a token itself, not only as a subtoken of a phrase, since taking this counter
+} COUNTER;
+
+/* SpaceSaving heavy-hitter summary (Metwally et al., 2005): at most capacity counters, the one with the
+   smallest count is reassigned to each new word once all are in use */
+typedef struct space_saving {
+    COUNTER *counters;
+    long long *heap; // indices into counters, min-heap on count
+    long long *index; // open addressing over counters by hash; -1 marks an empty slot
+    long long capacity, num, mask;
+} SPACESAVING;
+
+/* A word, or a phrase's contribution to one of its subtokens, while writing a sorted run */
+typedef struct run_item {
+    char *word; // not null-terminated
+    int len;
+    long long count; // occurrences as a token
+    long long sub; // occurrences as a subtoken of a phrase
+} RUNITEM;
+
+/* Reader positioned at one record of a sorted run, used while merging runs */
+typedef struct run_reader {
+    FILE *fid;
+    char word[MAX_STRING_LENGTH];
+    int len;
+    long long count, sub;
+} RUNREADER;
+
 int verbose = 2; // 0, 1, or 2
 long long min_count = 1; // min occurrences for inclusion in vocab
 long long max_vocab = 0; // max_vocab = 0 for no limit
+int num_threads = 1; // pthreads; more than one requires a corpus file rather than a pipe
+char *corpus_file = NULL; // read corpus from this file instead of stdin
+long long approx_size = 0; // number of SpaceSaving counters; 0 for exact counting
+char *error_file = NULL; // approximate mode: write the error bound of each emitted count here
+real memory_limit = 0; // soft limit, in gigabytes, for exact counting; 0 for no limit
+char *file_head = "temp_vocab"; // temporary file string
+long long arena_limit = 0; // with memory_limit, spill a table to a sorted run once its words take this many bytes
+int num_runs = 0; // number of sorted runs spilled to temporary files
+char **merge_files = NULL; // vocab files to combine instead of counting a corpus
+int num_merge_files = 0;
+char *phrase_file = NULL; // write the subtoken ranks of each phrase in the vocabulary here
+char *binary_vocab_file = NULL; // also write the vocabulary here, in binary, with a perfect hash index
+pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Per-thread counting state: a byte range of the corpus and a private hash table or summary */
+typedef struct count_thread {
+    CORPUSREADER corpus; // view of a newline-aligned range of the corpus
+    HASHTABLE *vocab_hash;
+    SPACESAVING *summary; // used instead of vocab_hash in approximate mode
+    long long tokens;
+    int status; // 0 on success
+} COUNTTHREAD;
 
 
 /* Vocab frequency comparison; break ties alphabetically */
@@ -47,153 +117,936 @@ int CompareVocabTie(const void *a, const void *b) {
     
 }
 
-/* Vocab frequency comparison; no tie-breaker */
+/* Vocab frequency comparison; break ties by a hash of the word, so that equally frequent words are
+   ordered pseudo-randomly (spanning the whole alphabet) but independently of the counting order */
 int CompareVocab(const void *a, const void *b) {
     long long c;
     if ( (c = ((VOCAB *) b)->count - ((VOCAB *) a)->count) != 0) return ( c > 0 ? 1 : -1 );
-    else return 0;
+    if (((VOCAB *) a)->tie != ((VOCAB *) b)->tie) return ( ((VOCAB *) a)->tie > ((VOCAB *) b)->tie ? 1 : -1 );
+    return (scmp(((VOCAB *) a)->word,((VOCAB *) b)->word));
 }
 
-/* Search hash table for given string, insert if not found */
-void hashinsert(HASHREC **ht, char *w) {
-    HASHREC     *htmp, *hprv;
-    unsigned int str_hash_value = HASHFN(w, TSIZE, SEED);
-    
-    // htmp: current pointer, hprv: previous pointer
-    hprv = NULL, htmp = ht[str_hash_value];
-    while(htmp != NULL && scmp(htmp->word, w) != 0) { // searching for string in its bucket
-        hprv = htmp, htmp = htmp->next; // walking both pointers at once
-    }
-    if (htmp == NULL) { // string isnt in bucket, adding now
-        htmp = (HASHREC *) malloc( sizeof(HASHREC) );
-        htmp->word = (char *) malloc( strlen(w) + 1 );
-        strcpy(htmp->word, w);
-        htmp->num = 1;
-        htmp->next = NULL;
-        if (hprv == NULL)
-            ht[str_hash_value] = htmp;
-        else
-            hprv->next = htmp;
-        /* new records are not moved to front */
-    }
-    else { // string is in bucket, increments counter and moves to front
-        htmp->num++;
-        if (hprv != NULL) { // isnt an empty list
-            /* moves to first position of linked list */
-            hprv->next = htmp->next;
-            htmp->next = ht[str_hash_value];
-            ht[str_hash_value] = htmp;
-        }
-    }
-    return;
+/* Search and, if found, increment */
+void hashincrement(HASHTABLE *ht, char *w, int len, long long value) {
+    HASHENTRY *htmp = hashtable_search(ht, w, len);
+    if (htmp != NULL) htmp->num += value; // wont increment non existent entries
 }
 
-/* Search and, if found, increment */
-void hashincrement(HASHREC **ht, char *w, int value) {
-    HASHREC     *htmp, *hprv;
-    unsigned int str_hash_value = HASHFN(w, TSIZE, SEED);
-    
-    // htmp: current pointer, hprv: previous pointer
-    hprv = NULL, htmp = ht[str_hash_value];
-    while(htmp != NULL && scmp(htmp->word, w) != 0){ // searching for string in its bucket
-        hprv = htmp, htmp = htmp->next; // walking both pointers at once
+/* Add the counts of src into dst; frees src. Returns 1 if out of memory, 0 otherwise. */
+int hashmerge(HASHTABLE *dst, HASHTABLE *src) {
+    HASHENTRY *htmp;
+    long long a;
+
+    for (a = 0; a < src->size; a++) {
+        if (src->slots[a].hash == 0) continue;
+        htmp = hashtable_insert(dst, HASHWORD(src, &src->slots[a]), strlen(HASHWORD(src, &src->slots[a])));
+        if (htmp == NULL) {hashtable_free(src); return 1;}
+        htmp->num += src->slots[a].num;
+    }
+    hashtable_free(src);
+    return 0;
+}
+
+/* Create a SpaceSaving summary with capacity counters */
+SPACESAVING *ss_create(long long capacity) {
+    SPACESAVING *ss = (SPACESAVING *) malloc(sizeof(SPACESAVING));
+    long long a;
+    if (ss == NULL) return NULL;
+    ss->capacity = capacity;
+    ss->num = 0;
+    for (ss->mask = 1; ss->mask < 2 * capacity; ss->mask <<= 1);
+    ss->counters = (COUNTER *) calloc(capacity, sizeof(COUNTER));
+    ss->heap = (long long *) malloc(sizeof(long long) * capacity);
+    ss->index = (long long *) malloc(sizeof(long long) * ss->mask);
+    if (ss->counters == NULL || ss->heap == NULL || ss->index == NULL) {
+        free(ss->counters);
+        free(ss->heap);
+        free(ss->index);
+        free(ss);
+        return NULL;
+    }
+    for (a = 0; a < ss->mask; a++) ss->index[a] = -1;
+    ss->mask--;
+    return ss;
+}
+
+void ss_free(SPACESAVING *ss) {
+    long long a;
+    if (ss == NULL) return;
+    for (a = 0; a < ss->capacity; a++) free(ss->counters[a].word); // including counters dropped by ss_merge
+    free(ss->counters);
+    free(ss->heap);
+    free(ss->index);
+    free(ss);
+}
+
+/* Smallest count in the summary; any word without a counter occurred at most this often */
+long long ss_min(SPACESAVING *ss) {
+    return ss->num < ss->capacity ? 0 : ss->counters[ss->heap[0]].count;
+}
+
+/* Restore the heap property after the count at heap position p increased */
+void ss_sift_down(SPACESAVING *ss, long long p) {
+    long long c, tmp, n = ss->num, *heap = ss->heap;
+    COUNTER *counters = ss->counters;
+    while ((c = 2 * p + 1) < n) {
+        if (c + 1 < n && counters[heap[c + 1]].count < counters[heap[c]].count) c++;
+        if (counters[heap[p]].count <= counters[heap[c]].count) break;
+        tmp = heap[p]; heap[p] = heap[c]; heap[c] = tmp;
+        counters[heap[p]].heap = p;
+        counters[heap[c]].heap = c;
+        p = c;
+    }
+}
+
+/* Restore the heap property after appending at heap position p */
+void ss_sift_up(SPACESAVING *ss, long long p) {
+    long long q, tmp, *heap = ss->heap;
+    COUNTER *counters = ss->counters;
+    while (p > 0 && counters[heap[q = (p - 1) / 2]].count > counters[heap[p]].count) {
+        tmp = heap[p]; heap[p] = heap[q]; heap[q] = tmp;
+        counters[heap[p]].heap = p;
+        counters[heap[q]].heap = q;
+        p = q;
+    }
+}
+
+/* Index slot holding word w (hash h), or the empty slot where it would go */
+long long ss_slot(SPACESAVING *ss, char *w, int len, unsigned long long h) {
+    long long a, c;
+    for (a = h & ss->mask; (c = ss->index[a]) >= 0; a = (a + 1) & ss->mask) {
+        if (ss->counters[c].hash == h && sncmp(ss->counters[c].word, w, len) == 0) break;
+    }
+    return a;
+}
+
+/* Remove counter c from the index, shifting back later entries of its probe sequence */
+void ss_unindex(SPACESAVING *ss, long long c) {
+    long long a, b, home;
+    for (a = ss->counters[c].hash & ss->mask; ss->index[a] != c; a = (a + 1) & ss->mask);
+    for ( ; ; ) {
+        ss->index[a] = -1;
+        for (b = (a + 1) & ss->mask; ss->index[b] >= 0; b = (b + 1) & ss->mask) {
+            home = ss->counters[ss->index[b]].hash & ss->mask;
+            if ((a < b) ? (home <= a || home > b) : (home <= a && home > b)) break; // entry at b may move to a
+        }
+        if (ss->index[b] < 0) return;
+        ss->index[a] = ss->index[b];
+        a = b;
+    }
+}
+
+/* Assign counter c to the len bytes at w. Returns 1 if out of memory, 0 otherwise. */
+int ss_set_word(COUNTER *counter, char *w, int len, unsigned long long h) {
+    if (counter->alloc < len + 1) {
+        free(counter->word);
+        counter->alloc = len + 1 > 16 ? len + 1 : 16;
+        if ((counter->word = (char *) malloc(counter->alloc)) == NULL) return 1;
+    }
+    memcpy(counter->word, w, len);
+    counter->word[len] = '\0';
+    counter->hash = h;
+    return 0;
+}
+
+/* Count one occurrence of the len bytes at w (value occurrences, with error bound error, when merging).
+   Returns 1 if out of memory, 0 otherwise. */
+int ss_add(SPACESAVING *ss, char *w, int len, unsigned long long h, long long value, long long error, int standalone) {
+    long long a = ss_slot(ss, w, len, h), c;
+    COUNTER *counter;
+    if ((c = ss->index[a]) >= 0) {
+        counter = &ss->counters[c];
+        counter->count += value;
+        counter->error += error;
+        counter->standalone |= standalone;
+        ss_sift_down(ss, counter->heap);
+        return 0;
+    }
+    if (ss->num < ss->capacity) { // a counter is still free
+        c = ss->num++;
+        counter = &ss->counters[c];
+        if (ss_set_word(counter, w, len, h) != 0) return 1;
+        counter->count = value;
+        counter->error = error;
+        counter->standalone = standalone;
+        counter->heap = c;
+        ss->heap[c] = c;
+        ss->index[a] = c;
+        ss_sift_up(ss, c);
+        return 0;
+    }
+    // Reassign the counter with the smallest count: the new word occurred at most that often before
+    c = ss->heap[0];
+    counter = &ss->counters[c];
+    ss_unindex(ss, c);
+    if (ss_set_word(counter, w, len, h) != 0) return 1;
+    counter->error = counter->count + error;
+    counter->count += value;
+    counter->standalone = standalone;
+    ss->index[ss_slot(ss, w, len, h)] = c;
+    ss_sift_down(ss, 0);
+    return 0;
+}
+
+/* Search the summary for the len bytes at w, return its counter if found, else NULL */
+COUNTER *ss_search(SPACESAVING *ss, char *w, int len) {
+    long long c = ss->index[ss_slot(ss, w, len, wordhash(w, len))];
+    return c >= 0 ? &ss->counters[c] : NULL;
+}
+
+/* Merge summary src into dst (Agarwal et al., Mergeable Summaries, 2012); frees src.
+   Returns 1 if out of memory, 0 otherwise. */
+int ss_merge(SPACESAVING *dst, SPACESAVING *src) {
+    long long a, min_dst = ss_min(dst), min_src = ss_min(src);
+    int status = 0;
+    COUNTER *counter, *other;
+    SPACESAVING *merged = ss_create(dst->capacity + src->capacity);
+    if (merged == NULL) {ss_free(src); return 1;}
+    // A word missing from one summary may still have occurred up to that summary's minimum count there
+    for (a = 0; a < dst->num; a++) {
+        counter = &dst->counters[a];
+        other = ss_search(src, counter->word, strlen(counter->word));
+        status |= ss_add(merged, counter->word, strlen(counter->word), counter->hash,
+                         counter->count + (other ? other->count : min_src), counter->error + (other ? other->error : min_src),
+                         counter->standalone | (other ? other->standalone : 0));
+    }
+    for (a = 0; a < src->num; a++) {
+        counter = &src->counters[a];
+        if (ss_search(dst, counter->word, strlen(counter->word)) != NULL) continue;
+        status |= ss_add(merged, counter->word, strlen(counter->word), counter->hash,
+                         counter->count + min_dst, counter->error + min_dst, counter->standalone);
+    }
+    ss_free(src);
+    if (status != 0) {ss_free(merged); return 1;}
+    // Keep the dst->capacity largest counts
+    for (a = 0; a <= dst->mask; a++) dst->index[a] = -1;
+    dst->num = 0;
+    while (merged->num > dst->capacity) {
+        merged->heap[0] = merged->heap[--merged->num];
+        merged->counters[merged->heap[0]].heap = 0;
+        ss_sift_down(merged, 0);
+    }
+    for (a = 0; a < merged->num; a++) {
+        counter = &merged->counters[merged->heap[a]];
+        status |= ss_add(dst, counter->word, strlen(counter->word), counter->hash, counter->count, counter->error, counter->standalone);
+    }
+    ss_free(merged);
+    return status;
+}
+
+/* Order run items by word, bytewise */
+int CompareRunItem(const void *a, const void *b) {
+    const RUNITEM *x = (const RUNITEM *) a, *y = (const RUNITEM *) b;
+    int c = memcmp(x->word, y->word, x->len < y->len ? x->len : y->len);
+    return c != 0 ? c : x->len - y->len;
+}
+
+/* Number of slots for a counting table: fixed by the memory limit when spilling, so tables never grow */
+long long table_slots() {
+    long long slots = 1;
+    if (arena_limit == 0) return TSIZE;
+    while (2 * slots * (long long) sizeof(HASHENTRY) <= arena_limit) slots *= 2;
+    return slots;
+}
+
+/* True once ht should be spilled: one more word would make it grow, or its words exceed their budget */
+int table_full(HASHTABLE *ht) {
+    return arena_limit > 0 && (2 * (ht->count + 1) > ht->size || ht->words.size > arena_limit);
+}
+
+/* Write the words of ht, sorted, to a new temporary run file and empty ht. Each phrase also contributes its count
+   to each of its subtokens, which is applied when the runs are merged, once it is known which subtokens occur by themselves.
+   Returns 1 on failure, 0 otherwise. */
+int write_run(HASHTABLE *ht) {
+    long long a, b, n = 0, capacity = 2 * ht->count + 1, count, sub;
+    int run, start, j;
+    char filename[MAX_STRING_LENGTH], *word;
+    RUNITEM *items = (RUNITEM *) malloc(sizeof(RUNITEM) * capacity), *tmp;
+    FILE *fout;
+
+    if (items == NULL) {fprintf(stderr, "Couldn't allocate memory!\n"); return 1;}
+    for (a = 0; a < ht->size; a++) {
+        if (ht->slots[a].hash == 0) continue;
+        word = HASHWORD(ht, &ht->slots[a]);
+        for (start = 0, j = 0; ; j++) {
+            if (n == capacity) {
+                if ((tmp = (RUNITEM *) realloc(items, sizeof(RUNITEM) * (capacity *= 2))) == NULL) {
+                    fprintf(stderr, "Couldn't allocate memory!\n");
+                    free(items);
+                    return 1;
+                }
+                items = tmp;
+            }
+            if (word[j] == '\0') break;
+            if (word[j] != SEP_CHAR || merge_files != NULL) continue; // merged counts already include phrases
+            if (j > start) {
+                items[n].word = word + start;
+                items[n].len = j - start;
+                items[n].count = 0;
+                items[n++].sub = ht->slots[a].num;
+            }
+            start = j + 1;
+        }
+        items[n].word = word;
+        items[n].len = j;
+        items[n].count = ht->slots[a].num;
+        items[n++].sub = 0;
+    }
+    qsort(items, n, sizeof(RUNITEM), CompareRunItem);
+
+    pthread_mutex_lock(&run_lock);
+    run = num_runs++;
+    pthread_mutex_unlock(&run_lock);
+    sprintf(filename, "%s_%04d.bin", file_head, run);
+    fout = fopen(filename, "wb");
+    if (fout == NULL) {
+        log_file_loading_error("temp file", filename);
+        free(items);
+        return 1;
+    }
+    for (a = 0; a < n; a = b) {
+        for (b = a, count = sub = 0; b < n && CompareRunItem(&items[a], &items[b]) == 0; b++) {
+            count += items[b].count;
+            sub += items[b].sub;
+        }
+        fwrite(&items[a].len, sizeof(int), 1, fout);
+        fwrite(items[a].word, 1, items[a].len, fout);
+        fwrite(&count, sizeof(long long), 1, fout);
+        fwrite(&sub, sizeof(long long), 1, fout);
+    }
+    fclose(fout);
+    free(items);
+    hashtable_clear(ht);
+    return 0;
+}
+
+/* Read the next record of a run; returns 0 on success, 1 at the end of the run */
+int read_run(RUNREADER *r) {
+    if (fread(&r->len, sizeof(int), 1, r->fid) != 1) return 1;
+    if (fread(r->word, 1, r->len, r->fid) != (size_t) r->len) return 1;
+    if (fread(&r->count, sizeof(long long), 1, r->fid) != 1) return 1;
+    if (fread(&r->sub, sizeof(long long), 1, r->fid) != 1) return 1;
+    return 0;
+}
+
+/* Check if reader a is at a word that sorts after that of reader b */
+int run_after(RUNREADER *a, RUNREADER *b) {
+    int c = memcmp(a->word, b->word, a->len < b->len ? a->len : b->len);
+    return c != 0 ? c > 0 : a->len > b->len;
+}
+
+/* Restore the heap of run readers below position p */
+void run_sift_down(RUNREADER **pq, int size, int p) {
+    int c;
+    RUNREADER *tmp;
+    while ((c = 2 * p + 1) < size) {
+        if (c + 1 < size && run_after(pq[c], pq[c + 1])) c++;
+        if (!run_after(pq[p], pq[c])) break;
+        tmp = pq[p]; pq[p] = pq[c]; pq[c] = tmp;
+        p = c;
+    }
+}
+
+/* Runs merged at once: MAX_MERGE_RUNS, or fewer if the limit on open files is lower */
+int merge_fan_in() {
+    struct rlimit limit;
+    int fan_in = MAX_MERGE_RUNS;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && (long long) limit.rlim_cur - 16 < fan_in) fan_in = (int) limit.rlim_cur - 16;
+    return fan_in < 2 ? 2 : fan_in;
+}
+
+/* Open the runs first .. first + num - 1 into readers and heap those with records in pq. Returns the number heaped,
+   or -1 if a run can't be opened. */
+int runs_open(RUNREADER *readers, RUNREADER **pq, int first, int num) {
+    int a, live = 0;
+    char filename[MAX_STRING_LENGTH];
+    for (a = 0; a < num; a++) {
+        sprintf(filename, "%s_%04d.bin", file_head, first + a);
+        readers[a].fid = fopen(filename, "rb");
+        if (readers[a].fid == NULL) {
+            log_file_loading_error("temp file", filename);
+            return -1;
+        }
+        if (read_run(&readers[a]) == 0) pq[live++] = &readers[a];
+    }
+    for (a = live / 2 - 1; a >= 0; a--) run_sift_down(pq, live, a);
+    return live;
+}
+
+/* Pop every record of the smallest word in the heap of live readers into word and len, adding up its counts.
+   Returns the number of readers left. */
+int runs_next(RUNREADER **pq, int live, char *word, int *len, long long *count, long long *sub) {
+    *len = pq[0]->len;
+    memcpy(word, pq[0]->word, *len);
+    *count = *sub = 0;
+    while (live > 0 && pq[0]->len == *len && memcmp(pq[0]->word, word, *len) == 0) {
+        *count += pq[0]->count;
+        *sub += pq[0]->sub;
+        if (read_run(pq[0]) != 0) pq[0] = pq[--live];
+        run_sift_down(pq, live, 0);
+    }
+    return live;
+}
+
+void remove_run(int run) {
+    char filename[MAX_STRING_LENGTH];
+    sprintf(filename, "%s_%04d.bin", file_head, run);
+    remove(filename);
+}
+
+/* Close the readers of runs first .. first + num - 1 and remove the runs */
+void runs_close(RUNREADER *readers, int first, int num) {
+    int a;
+    for (a = 0; a < num; a++) {
+        if (readers[a].fid != NULL) fclose(readers[a].fid);
+        readers[a].fid = NULL;
+        remove_run(first + a);
+    }
+}
+
+/* Merge runs first .. first + num - 1 into the new run num_runs, adding up the counts of each word.
+   Returns 1 on failure, 0 otherwise. */
+int merge_run_group(RUNREADER *readers, RUNREADER **pq, int first, int num) {
+    int live, len, status = 0;
+    long long count, sub;
+    char filename[MAX_STRING_LENGTH], word[MAX_STRING_LENGTH];
+    FILE *fout;
+
+    sprintf(filename, "%s_%04d.bin", file_head, num_runs);
+    if ((fout = fopen(filename, "wb")) == NULL) return log_file_loading_error("temp file", filename) != 0;
+    if ((live = runs_open(readers, pq, first, num)) < 0) status = 1;
+    while (status == 0 && live > 0) {
+        live = runs_next(pq, live, word, &len, &count, &sub);
+        fwrite(&len, sizeof(int), 1, fout);
+        fwrite(word, 1, len, fout);
+        fwrite(&count, sizeof(long long), 1, fout);
+        if (fwrite(&sub, sizeof(long long), 1, fout) != 1) status = 1;
+    }
+    if (fclose(fout) != 0) status = 1;
+    if (status != 0 && live >= 0) fprintf(stderr, "Couldn't write temp file %s.\n", filename);
+    runs_close(readers, first, num);
+    num_runs++;
+    return status;
+}
+
+/* Keep the max_vocab most frequent of the n words in vocab (ordered as by CompareVocab), moving their words to
+   a fresh arena. Words are given by their offsets into words until the merge ends. */
+int keep_most_frequent(VOCAB *vocab, long long *n, ARENA *words) {
+    long long a, offset;
+    ARENA kept;
+    for (a = 0; a < *n; a++) vocab[a].word = words->data + vocab[a].offset;
+    qsort(vocab, *n, sizeof(VOCAB), CompareVocab);
+    *n = max_vocab;
+    if (arena_init(&kept, words->capacity / 2) != 0) return 1;
+    for (a = 0; a < *n; a++) {
+        if ((offset = arena_add(&kept, vocab[a].word, strlen(vocab[a].word))) < 0) {arena_free(&kept); return 1;}
+        vocab[a].offset = offset;
+    }
+    arena_free(words);
+    *words = kept;
+    return 0;
+}
+
+/* Merge the sorted runs, adding up the counts of each word, into an array of the words occurring at least min_count
+   times (and, with max_vocab, only the max_vocab most frequent, selected as they stream by). Word pointers point into
+   words. Returns 1 on failure, 0 otherwise. */
+int merge_runs(VOCAB **vocab_out, long long *size, ARENA *words, long long *unique) {
+    int a, live = 0, status = 0, first = 0, fan_in = merge_fan_in();
+    long long n = 0, capacity = max_vocab > 0 ? 2 * max_vocab : 1048576, count, sub, offset;
+    char word[MAX_STRING_LENGTH];
+    int len;
+    RUNREADER *readers = (RUNREADER *) calloc(fan_in, sizeof(RUNREADER)), **pq = (RUNREADER **) malloc(fan_in * sizeof(RUNREADER *));
+    VOCAB *vocab = (VOCAB *) malloc(sizeof(VOCAB) * (capacity + 1)), *tmp;
+
+    *unique = 0;
+    if (readers == NULL || pq == NULL || vocab == NULL || arena_init(words, 1048576) != 0) {
+        fprintf(stderr, "Couldn't allocate memory!\n");
+        free(readers); free(pq); free(vocab);
+        return 1;
+    }
+    if (verbose > 1) fprintf(stderr, "Merging %d temporary files.\n", num_runs);
+    // With more runs than can be open at once, merge the oldest into intermediate runs until few enough are left
+    while (status == 0 && num_runs - first > fan_in) {
+        status = merge_run_group(readers, pq, first, fan_in);
+        first += fan_in;
+    }
+    if (status == 0 && (live = runs_open(readers, pq, first, num_runs - first)) < 0) status = 1;
+
+    while (status == 0 && live > 0) {
+        live = runs_next(pq, live, word, &len, &count, &sub);
+        if (count == 0) continue; // only ever seen inside phrases
+        (*unique)++;
+        if (count + sub < min_count) continue;
+        if (n == capacity) {
+            if (max_vocab > 0) status = keep_most_frequent(vocab, &n, words);
+            else if ((tmp = (VOCAB *) realloc(vocab, sizeof(VOCAB) * ((capacity *= 2) + 1))) == NULL) status = 1;
+            else vocab = tmp;
+        }
+        if (status == 0 && (offset = arena_add(words, word, len)) < 0) status = 1;
+        if (status != 0) {
+            fprintf(stderr, "Couldn't allocate memory!\n");
+            break;
+        }
+        vocab[n].offset = offset; // the arena may move until the merge ends
+        vocab[n].error = 0;
+        vocab[n].count = count + sub;
+        vocab[n].tie = wordhash(word, len);
+        n++;
+    }
+    runs_close(readers, first, num_runs - first < fan_in ? num_runs - first : fan_in);
+    for (a = first + fan_in; a < num_runs; a++) remove_run(a); // left by a failed intermediate merge
+    free(readers);
+    free(pq);
+    if (status != 0) { // reported where it failed
+        free(vocab);
+        arena_free(words);
+        return 1;
+    }
+    for (offset = 0; offset < n; offset++) vocab[offset].word = words->data + vocab[offset].offset;
+    *vocab_out = vocab;
+    *size = n;
+    return 0;
+}
+
+/* Insert all tokens of corpus into vocab_hash, or into summary if it is not NULL.
+   Returns 1 if the corpus contains <unk> or memory runs out, 0 otherwise. */
+int count_tokens(HASHTABLE *vocab_hash, SPACESAVING *summary, CORPUSREADER *corpus, long long *tokens) {
+    HASHENTRY *htmp;
+    char *str, *sub, *end;
+    int len, nl, status;
+    long long i = 0;
+
+    while ((nl = corpus_next_token(corpus, &str, &len)) != EOF) {
+        if (nl) continue; // just a newline marker
+        if (len == 5 && memcmp(str, "<unk>", 5) == 0) {
+            fprintf(stderr, "\nError, <unk> vector found in corpus.\nPlease remove <unk>s from your corpus (e.g. cat text8 | sed -e 's/<unk>/<raw_unk>/g' > text8.new)");
+            return 1;
+        }
+        if (summary != NULL) {
+            status = ss_add(summary, str, len, wordhash(str, len), 1, 0, 1);
+            // Subtokens of phrases are counted as they stream by, so that their bounds hold too
+            for (sub = str; (end = (char *) memchr(sub, SEP_CHAR, str + len - sub)) != NULL; sub = end + 1) {
+                if (end > sub) status |= ss_add(summary, sub, end - sub, wordhash(sub, end - sub), 1, 0, 0);
+            }
+            if (status != 0) {
+                fprintf(stderr, "\nCouldn't allocate memory!\n");
+                return 1;
+            }
+        }
+        else if ((htmp = hashtable_insert(vocab_hash, str, len)) == NULL) {
+            fprintf(stderr, "\nCouldn't allocate memory!\n");
+            return 1;
+        }
+        else {
+            htmp->num++;
+            if (table_full(vocab_hash) && write_run(vocab_hash) != 0) return 1;
+        }
+        if (((++i)%100000) == 0) if (verbose > 1 && num_threads == 1) fprintf(stderr,"\033[11G%lld tokens.", i);
+    }
+    *tokens = i;
+    return 0;
+}
+
+/* Add up the counts of the vocab files in merge_files into vocab_hash, spilling it to sorted runs if it fills up.
+   Returns 1 if a file can't be read or memory runs out, 0 otherwise. */
+int merge_vocab_files(HASHTABLE *vocab_hash, long long *tokens) {
+    char format[20], str[MAX_STRING_LENGTH + 1];
+    long long count;
+    int a, items;
+    FILE *fid;
+    HASHENTRY *htmp;
+
+    *tokens = 0;
+    sprintf(format,"%%%ds %%lld", MAX_STRING_LENGTH);
+    for (a = 0; a < num_merge_files; a++) {
+        if (verbose > 1) fprintf(stderr, "Reading vocab from file \"%s\".\n", merge_files[a]);
+        fid = fopen(merge_files[a], "r");
+        if (fid == NULL) {
+            log_file_loading_error("vocab file", merge_files[a]);
+            return 1;
+        }
+        while ((items = fscanf(fid, format, str, &count)) == 2) {
+            if ((htmp = hashtable_insert(vocab_hash, str, strlen(str))) == NULL) {
+                fprintf(stderr, "Couldn't allocate memory!\n");
+                fclose(fid);
+                return 1;
+            }
+            htmp->num += count;
+            *tokens += count;
+            if (table_full(vocab_hash) && write_run(vocab_hash) != 0) {fclose(fid); return 1;}
+        }
+        fclose(fid);
+        if (items != EOF) {
+            fprintf(stderr, "Malformed vocab file \"%s\"; expected lines of the form 'word count'.\n", merge_files[a]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Count one range of the corpus into a private hash table or summary */
+void *count_thread(void *arg) {
+    COUNTTHREAD *t = (COUNTTHREAD *) arg;
+    t->status = count_tokens(t->vocab_hash, t->summary, &t->corpus, &t->tokens);
+    pthread_exit(NULL);
+}
+
+/* Split the corpus into num_threads newline-aligned ranges, count them in parallel and merge the tables
+   (or, in approximate mode, the summaries, returned through summary). Returns 1 on failure, 0 otherwise. */
+int count_parallel(CORPUSREADER *corpus, HASHTABLE **vocab_hash, SPACESAVING **summary, long long *tokens) {
+    long long a, *starts;
+    int status = 0;
+    COUNTTHREAD *threads;
+    pthread_t *pt;
+
+    starts = (long long *) malloc((num_threads + 1) * sizeof(long long));
+    if (corpus_split(corpus, num_threads, starts) != 0) {
+        fprintf(stderr, "Error, -threads requires a corpus file that can be mapped into memory.\n");
+        free(starts);
+        return 1;
+    }
+    threads = calloc(num_threads, sizeof(COUNTTHREAD));
+    pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    for (a = 0; a < num_threads; a++) {
+        corpus_view(&threads[a].corpus, corpus, starts[a], starts[a + 1]);
+        if (approx_size > 0) status |= (threads[a].summary = ss_create(approx_size)) == NULL;
+        else status |= (threads[a].vocab_hash = hashtable_create(table_slots())) == NULL;
+    }
+    if (status != 0) {
+        fprintf(stderr, "Couldn't allocate memory!\n");
+        for (a = 0; a < num_threads; a++) {
+            hashtable_free(threads[a].vocab_hash);
+            ss_free(threads[a].summary);
+        }
+        free(threads);
+        free(pt);
+        free(starts);
+        return 1;
+    }
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, count_thread, (void *)&threads[a]);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+
+    *tokens = 0;
+    *vocab_hash = threads[0].vocab_hash;
+    *summary = threads[0].summary;
+    for (a = 0; a < num_threads; a++) {
+        status |= threads[a].status;
+        *tokens += threads[a].tokens;
+        if (num_runs > 0 && threads[a].vocab_hash != NULL) { // some tables spilled: spill all of them
+            status |= write_run(threads[a].vocab_hash);
+            if (a > 0) hashtable_free(threads[a].vocab_hash);
+            continue;
+        }
+        if (a == 0) continue;
+        if (approx_size > 0) status |= ss_merge(*summary, threads[a].summary);
+        else status |= hashmerge(*vocab_hash, threads[a].vocab_hash);
+    }
+    free(threads);
+    free(pt);
+    free(starts);
+    if (status != 0) {
+        hashtable_free(*vocab_hash);
+        ss_free(*summary);
+        return 1;
+    }
+    return 0;
+}
+
+/* Increment occurences of subtokens from phrases (separated by SEP_CHAR) by the count of the phrase.
+   bipartite DAG, no specific token processing order is needed
+   if subtokens exists, increments counts; if it doesnt, skips */
+void count_subtokens(HASHTABLE *vocab_hash) {
+    long long i;
+    char *word, *end;
+
+    for (i = 0; i < vocab_hash->size; i++) {
+        if (vocab_hash->slots[i].hash == 0) continue;
+        word = HASHWORD(vocab_hash, &vocab_hash->slots[i]);
+        for (; (end = strchr(word, SEP_CHAR)) != NULL; word = end + 1) {
+            hashincrement(vocab_hash, word, end - word, vocab_hash->slots[i].num);
+        }
+    }
+}
+
+/* Write the phrase index of the sorted vocabulary to phrase_file: for each phrase, a line with its rank, the number of
+   its subtokens in the vocabulary and their ranks, so that cooccur need not split phrases. Returns 1 on failure, 0 otherwise. */
+int write_phrases(VOCAB *vocab, long long size) {
+    long long i;
+    int a, n, ids[MAX_STRING_LENGTH / 2 + 1];
+    HASHENTRY *htmp;
+    HASHTABLE *ranks = hashtable_create(2 * size);
+    FILE *fout;
+
+    if (ranks == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!\n");
+        return 1;
+    }
+    for (i = 0; i < size; i++) {
+        if ((htmp = hashtable_insert(ranks, vocab[i].word, strlen(vocab[i].word))) == NULL) {
+            fprintf(stderr, "Couldn't allocate memory!\n");
+            hashtable_free(ranks);
+            return 1;
+        }
+        htmp->num = i + 1;
+    }
+    if ((fout = fopen(phrase_file, "w")) == NULL) {
+        log_file_loading_error("phrase file", phrase_file);
+        hashtable_free(ranks);
+        return 1;
+    }
+    for (i = 0; i < size; i++) {
+        if (strchr(vocab[i].word, SEP_CHAR) == NULL) continue;
+        n = phrase_subtokens(vocab[i].word, strlen(vocab[i].word), hashtable_num, ranks, ids);
+        fprintf(fout, "%lld %d", i + 1, n);
+        for (a = 0; a < n; a++) fprintf(fout, " %d", ids[a]);
+        fprintf(fout, "\n");
+    }
+    fclose(fout);
+    hashtable_free(ranks);
+    return 0;
+}
+
+/* Rearrange vocab so that its first k entries are the k first in CompareVocab order, and vocab[k] is next */
+void select_vocab(VOCAB *vocab, long long n, long long k) {
+    long long lo = 0, hi = n - 1, i, j;
+    VOCAB pivot, tmp;
+    while (lo < hi) {
+        // Median of three as the pivot
+        i = lo + (hi - lo) / 2;
+        if (CompareVocab(&vocab[i], &vocab[lo]) < 0) {tmp = vocab[i]; vocab[i] = vocab[lo]; vocab[lo] = tmp;}
+        if (CompareVocab(&vocab[hi], &vocab[lo]) < 0) {tmp = vocab[hi]; vocab[hi] = vocab[lo]; vocab[lo] = tmp;}
+        if (CompareVocab(&vocab[hi], &vocab[i]) < 0) {tmp = vocab[hi]; vocab[hi] = vocab[i]; vocab[i] = tmp;}
+        pivot = vocab[i];
+        for (i = lo, j = hi; i <= j; ) {
+            while (CompareVocab(&vocab[i], &pivot) < 0) i++;
+            while (CompareVocab(&pivot, &vocab[j]) < 0) j--;
+            if (i <= j) {tmp = vocab[i]; vocab[i] = vocab[j]; vocab[j] = tmp; i++; j--;}
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else return;
+    }
+}
+
+/* One piece of the parallel sort: sort vocab[start, mid) on its own, or merge the sorted vocab[start, mid) and vocab[mid, end) into out */
+typedef struct sort_task {
+    VOCAB *vocab, *out;
+    long long start, mid, end;
+} SORTTASK;
+
+void *sort_thread(void *arg) {
+    SORTTASK *t = (SORTTASK *) arg;
+    long long i = t->start, j = t->mid, k = t->start;
+    if (t->out == NULL) {
+        qsort(t->vocab + t->start, t->mid - t->start, sizeof(VOCAB), CompareVocabTie);
+        return NULL;
+    }
+    while (i < t->mid && j < t->end) t->out[k++] = (CompareVocabTie(&t->vocab[j], &t->vocab[i]) < 0) ? t->vocab[j++] : t->vocab[i++];
+    while (i < t->mid) t->out[k++] = t->vocab[i++];
+    while (j < t->end) t->out[k++] = t->vocab[j++];
+    return NULL;
+}
+
+/* Sort vocab by CompareVocabTie with num_threads threads: sort equal slices, then merge pairs of slices in rounds */
+void sort_vocab(VOCAB *vocab, long long n) {
+    int a, slices = num_threads, width;
+    long long *bounds;
+    VOCAB *buffer, *src = vocab, *dst, *tmp;
+    pthread_t *pt;
+    SORTTASK *tasks;
+
+    if (slices > 1 && n / slices < 65536) slices = n / 65536 > 1 ? n / 65536 : 1; // not worth a thread
+    buffer = (slices > 1) ? malloc(sizeof(VOCAB) * n) : NULL;
+    if (buffer == NULL) {
+        qsort(vocab, n, sizeof(VOCAB), CompareVocabTie);
+        return;
     }
-    if (htmp != NULL) { // wont increment non existent entries
-        htmp->num += value;
-        if (hprv != NULL) { // isnt an empty list
-            /* moves to first position of linked list */
-            hprv->next = htmp->next;
-            htmp->next = ht[str_hash_value];
-            ht[str_hash_value] = htmp;
+    bounds = malloc(sizeof(long long) * (slices + 1));
+    pt = malloc(sizeof(pthread_t) * slices);
+    tasks = malloc(sizeof(SORTTASK) * slices);
+    for (a = 0; a <= slices; a++) bounds[a] = (a == slices) ? n : n / slices * a;
+    for (a = 0; a < slices; a++) {
+        tasks[a].vocab = vocab; tasks[a].out = NULL;
+        tasks[a].start = bounds[a]; tasks[a].mid = bounds[a + 1];
+        pthread_create(&pt[a], NULL, sort_thread, (void *)&tasks[a]);
+    }
+    for (a = 0; a < slices; a++) pthread_join(pt[a], NULL);
+    for (dst = buffer, width = 1; width < slices; width *= 2) {
+        for (a = 0; a < slices; a += 2 * width) {
+            tasks[a].vocab = src; tasks[a].out = dst;
+            tasks[a].start = bounds[a];
+            tasks[a].mid = bounds[a + width < slices ? a + width : slices];
+            tasks[a].end = bounds[a + 2 * width < slices ? a + 2 * width : slices];
+            pthread_create(&pt[a], NULL, sort_thread, (void *)&tasks[a]);
         }
+        for (a = 0; a < slices; a += 2 * width) pthread_join(pt[a], NULL);
+        tmp = src; src = dst; dst = tmp;
+    }
+    if (src != vocab) memcpy(vocab, src, sizeof(VOCAB) * n);
+    free(buffer);
+    free(bounds);
+    free(pt);
+    free(tasks);
+}
+
+/* Write the sorted vocabulary to binary_vocab_file. Returns 1 on failure, 0 otherwise. */
+int write_binary_vocab(VOCAB *vocab, long long size) {
+    long long i;
+    int status;
+    char **words = malloc(sizeof(char *) * (size + 1));
+    long long *counts = malloc(sizeof(long long) * (size + 1));
+
+    if (words == NULL || counts == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!\n");
+        free(words);
+        free(counts);
+        return 1;
     }
-    return;
+    for (i = 0; i < size; i++) {
+        words[i] = vocab[i].word;
+        counts[i] = vocab[i].count;
+    }
+    status = bvocab_write(binary_vocab_file, words, counts, size);
+    free(words);
+    free(counts);
+    return status;
+}
+
+/* Truncate vocab at min_count occurrences and max_vocab words, sort the words kept by frequency, and print them.
+   Returns 1 if the phrase index or binary vocabulary can't be written, 0 otherwise. */
+int write_vocab(VOCAB *vocab, long long j, SPACESAVING *summary) {
+    long long i, kept, guaranteed = 0, max_error = 0, threshold, best_dropped = 0;
+    FILE *ferr = NULL;
+
+    // Drop words under min_count first, so that only words that can be printed get selected and sorted
+    for (i = 0, kept = 0; i < j; i++) {
+        if (vocab[i].count >= min_count) vocab[kept++] = vocab[i];
+        else if (vocab[i].count > best_dropped) best_dropped = vocab[i].count;
+    }
+    if (kept < j && verbose > 0) fprintf(stderr, "Truncating vocabulary at min count %lld.\n",min_count);
+    // In approximate mode, a word is certainly among the most frequent if its lower bound beats every word left out
+    threshold = (summary != NULL) ? ss_min(summary) : 0;
+    if (max_vocab > 0 && max_vocab < kept) {
+        // If the vocabulary exceeds limit, select the most frequent words, breaking ties by a hash of the word.
+        // This results in pseudo-random ordering for words with same frequency, so that when truncated, the words span whole alphabet
+        select_vocab(vocab, kept, max_vocab);
+        if (vocab[max_vocab].count > best_dropped) best_dropped = vocab[max_vocab].count;
+        if (verbose > 0) fprintf(stderr, "Truncating vocabulary at size %lld.\n", max_vocab);
+        kept = max_vocab;
+    }
+    if (summary != NULL && max_vocab > 0 && max_vocab < j && best_dropped > threshold) threshold = best_dropped;
+    sort_vocab(vocab, kept); //After (possibly) truncating, sort, breaking ties alphabetically
+    
+    if (error_file != NULL && (ferr = fopen(error_file, "w")) == NULL) log_file_loading_error("error file", error_file);
+    for (i = 0; i < kept; i++) {
+        printf("%s %lld\n",vocab[i].word,vocab[i].count);
+        if (ferr != NULL) fprintf(ferr, "%s %lld %lld\n", vocab[i].word, vocab[i].count, vocab[i].error);
+        if (vocab[i].error > max_error) max_error = vocab[i].error;
+        if (vocab[i].count - vocab[i].error >= threshold) guaranteed++;
+    }
+    if (ferr != NULL) fclose(ferr);
+    
+    if (summary != NULL) {
+        fprintf(stderr, "Approximate counts exceed true counts by at most %lld; words left out occurred at most %lld times.\n", max_error, ss_min(summary));
+        fprintf(stderr, "%lld of %lld words are guaranteed to be among the most frequent.\n", guaranteed, kept);
+    }
+    fprintf(stderr, "Using vocabulary of size %lld.\n\n", kept);
+    if (binary_vocab_file != NULL && write_binary_vocab(vocab, kept) != 0) return 1;
+    return phrase_file != NULL ? write_phrases(vocab, kept) : 0;
 }
 
 int get_counts() {
-    long long i = 0, j = 0, k = 0, vocab_size = 12500;
-    // char format[20];
-    char str[MAX_STRING_LENGTH + 1], sub_str[MAX_STRING_LENGTH + 1];
-    HASHREC **vocab_hash = inithashtable();
-    HASHREC *htmp;
+    long long i = 0, j = 0;
+    int status;
+    HASHTABLE *vocab_hash = NULL;
+    SPACESAVING *summary = NULL;
+    HASHENTRY *htmp;
     VOCAB *vocab;
-    FILE *fid = stdin;
+    CORPUSREADER corpus;
+    ARENA words;
     
     fprintf(stderr, "BUILDING VOCABULARY\n");
-    if (verbose > 1) fprintf(stderr, "Processed %lld tokens.", i);
-    // sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-    while ( ! feof(fid)) {
-        // Insert all tokens into hashtable
-        int nl = get_word(str, fid);
-        if (nl) continue; // just a newline marker or feof
-        if (strcmp(str, "<unk>") == 0) {
-            fprintf(stderr, "\nError, <unk> vector found in corpus.\nPlease remove <unk>s from your corpus (e.g. cat text8 | sed -e 's/<unk>/<raw_unk>/g' > text8.new)");
-            free_table(vocab_hash);
+    if (merge_files != NULL) {
+        if (memory_limit > 0) arena_limit = (long long) (memory_limit * 1073741824 / 2);
+        if ((vocab_hash = hashtable_create(table_slots())) == NULL) {
+            fprintf(stderr, "Couldn't allocate memory!\n");
+            return 1;
+        }
+        status = merge_vocab_files(vocab_hash, &i);
+        if (status == 0 && num_runs > 0) status = write_run(vocab_hash);
+    }
+    else {
+        if (corpus_open(&corpus, corpus_file) != 0) {
+            log_file_loading_error("corpus file", corpus_file == NULL ? "stdin" : corpus_file);
             return 1;
         }
-        hashinsert(vocab_hash, str);
-        if (((++i)%100000) == 0) if (verbose > 1) fprintf(stderr,"\033[11G%lld tokens.", i);
+        if (approx_size > 0 && verbose > 1) fprintf(stderr, "Tracking at most %lld candidate words.\n", approx_size);
+        if (approx_size == 0 && memory_limit > 0) arena_limit = (long long) (memory_limit * 1073741824 / 2 / num_threads);
+        if (num_threads > 1) {
+            if (verbose > 1) fprintf(stderr, "Counting with %d threads.\n", num_threads);
+            status = count_parallel(&corpus, &vocab_hash, &summary, &i);
+        }
+        else {
+            if (verbose > 1) fprintf(stderr, "Processed %lld tokens.", i);
+            if (approx_size > 0) summary = ss_create(approx_size);
+            else vocab_hash = hashtable_create(table_slots());
+            if (vocab_hash == NULL && summary == NULL) {
+                fprintf(stderr, "Couldn't allocate memory!\n");
+                status = 1;
+            }
+            else status = count_tokens(vocab_hash, summary, &corpus, &i);
+            if (status == 0 && num_runs > 0) status = write_run(vocab_hash);
+        }
+        corpus_close(&corpus);
+    }
+    if (status != 0) {
+        hashtable_free(vocab_hash);
+        ss_free(summary);
+        return 1;
     }
     if (verbose > 1) fprintf(stderr, "\033[0GProcessed %lld tokens.\n", i);
 
-    // increment occorences of subtokens from phrases (separated by SEP_CHAR)
-    // bipartite DAG, no specific token processing order is needed
-    // if subtokens exists, increments counts; if it doesnt, skips
-    for (i = 0; i < TSIZE; i++) {
-        htmp = vocab_hash[i];
-        while (htmp != NULL) {
-            if (strchr(htmp->word, SEP_CHAR) != NULL){
-                k = 0;
-                for (j = 0; htmp->word[j]; j++, k++) {
-                    if (htmp->word[j] == SEP_CHAR) {
-                        sub_str[k] = '\0';
-                        hashincrement(vocab_hash, sub_str, htmp->num);
-                        k = -1;
-                    }
-                    else {
-                        sub_str[k] = htmp->word[j];
-                    }
-                }
-            }
-            htmp = htmp->next;
+    if (num_runs > 0) {
+        hashtable_free(vocab_hash);
+        vocab_hash = NULL;
+        if (merge_runs(&vocab, &j, &words, &i) != 0) return 1;
+        if (verbose > 1) fprintf(stderr, "Counted %lld unique words, %lld with at least %lld occurrences.\n", i, j, min_count);
+        status = write_vocab(vocab, j, NULL);
+        arena_free(&words);
+        free(vocab);
+        return status;
+    }
+    if (summary != NULL) { // subtokens were counted while streaming
+        vocab = malloc(sizeof(VOCAB) * (summary->num + 1));
+        for (i = 0, j = 0; i < summary->num; i++) {
+            if (!summary->counters[i].standalone) continue; // as with exact counts, subtokens only count as words if they occur by themselves
+            vocab[j].word = summary->counters[i].word;
+            vocab[j].count = summary->counters[i].count;
+            vocab[j].tie = summary->counters[i].hash;
+            vocab[j].error = summary->counters[i].error;
+            j++;
         }
     }
+    else {
+        if (merge_files == NULL) count_subtokens(vocab_hash);
 
-    vocab = malloc(sizeof(VOCAB) * vocab_size);
-    for (i = 0, j = 0; i < TSIZE; i++) { // Migrate vocab to array
-        htmp = vocab_hash[i];
-        while (htmp != NULL) {
-            vocab[j].word = htmp->word;
+        vocab = malloc(sizeof(VOCAB) * (vocab_hash->count + 1));
+        for (i = 0, j = 0; i < vocab_hash->size; i++) { // Migrate vocab to array
+            htmp = &vocab_hash->slots[i];
+            if (htmp->hash == 0) continue;
+            vocab[j].word = HASHWORD(vocab_hash, htmp);
             vocab[j].count = htmp->num;
+            vocab[j].tie = htmp->hash;
+            vocab[j].error = 0;
             j++;
-            if (j>=vocab_size) {
-                vocab_size += ARRAY_SIZE_INCREMENT;
-                vocab = (VOCAB *)realloc(vocab, sizeof(VOCAB) * vocab_size);
-            }
-            htmp = htmp->next;
         }
     }
     if (verbose > 1) fprintf(stderr, "Counted %lld unique words.\n", j);
-    if (max_vocab > 0 && max_vocab < j)
-        // If the vocabulary exceeds limit, first sort full vocab by frequency without alphabetical tie-breaks.
-        // This results in pseudo-random ordering for words with same frequency, so that when truncated, the words span whole alphabet
-        qsort(vocab, j, sizeof(VOCAB), CompareVocab);
-    else max_vocab = j;
-    qsort(vocab, max_vocab, sizeof(VOCAB), CompareVocabTie); //After (possibly) truncating, sort (possibly again), breaking ties alphabetically
-    
-    for (i = 0; i < max_vocab; i++) {
-        if (vocab[i].count < min_count) { // If a minimum frequency cutoff exists, truncate vocabulary
-            if (verbose > 0) fprintf(stderr, "Truncating vocabulary at min count %lld.\n",min_count);
-            break;
-        }
-        printf("%s %lld\n",vocab[i].word,vocab[i].count);
-    }
-    
-    if (i == max_vocab && max_vocab < j) if (verbose > 0) fprintf(stderr, "Truncating vocabulary at size %lld.\n", max_vocab);
-    fprintf(stderr, "Using vocabulary of size %lld.\n\n", i);
-    free_table(vocab_hash);
+    status = write_vocab(vocab, j, summary);
+    hashtable_free(vocab_hash);
+    ss_free(summary);
     free(vocab);
-    return 0;
+    return status;
 }
 
 int main(int argc, char **argv) {
@@ -208,8 +1061,29 @@ int main(int argc, char **argv) {
         printf("\t\tUpper bound on vocabulary size, i.e. keep the <int> most frequent words. The minimum frequency words are randomly sampled so as to obtain an even distribution over the alphabet.\n");
         printf("\t-min-count <int>\n");
         printf("\t\tLower limit such that words which occur fewer than <int> times are discarded.\n");
+        printf("\t-corpus-file <file>\n");
+        printf("\t\tRead the corpus from <file> instead of stdin. Files are mapped into memory rather than read.\n");
+        printf("\t-approx <int>\n");
+        printf("\t\tApproximate counting in bounded memory: track only <int> candidate words (SpaceSaving) instead of every distinct word.\n\t\tCounts are upper bounds; each is at most (tokens / <int>) too high. Use a value well above -max-vocab; default 0 (exact counting)\n");
+        printf("\t-error-file <file>\n");
+        printf("\t\tWith -approx, also write 'word count error' lines to <file>, where count - error is a lower bound on the true count\n");
+        printf("\t-memory <float>\n");
+        printf("\t\tSoft limit for memory consumption, in GB, of exact counting. When distinct words do not fit, sorted runs are spilled to\n\t\ttemporary files and merged at the end, applying -min-count and -max-vocab during the merge; default 0 (no limit)\n");
+        printf("\t-temp-file <file>\n");
+        printf("\t\tFilename, excluding extension, for temporary files; default temp_vocab\n");
+        printf("\t-merge <file> [<file> ...]\n");
+        printf("\t\tInstead of counting a corpus, add up the counts of vocab files written by vocab_count without -min-count or -max-vocab,\n\t\tthen truncate the result as usual. Must be the last option. Subtokens of phrases are only credited with a phrase's\n\t\tcount within a file, so a subtoken that never occurs by itself in the same shard as a phrase misses its count\n");
+        printf("\t-phrase-file <file>\n");
+        printf("\t\tAlso write the phrase index of the vocabulary to <file>: a line 'rank n subtoken_rank_1 ... subtoken_rank_n' for each phrase\n\t\t(word joined by SEP_CHAR), listing its subtokens in the vocabulary. Pass it to cooccur with the vocabulary\n");
+        printf("\t-binary-vocab <file>\n");
+        printf("\t\tAlso write the vocabulary to <file> in binary, with a perfect hash index, for cooccur and glove to map instead of parsing\n");
+        printf("\t-threads <int>\n");
+        printf("\t\tNumber of threads; default 1. The corpus is split into line-aligned ranges counted in parallel, so it must be a file (-corpus-file or redirected stdin), not a pipe.\n");
         printf("\nExample usage:\n");
         printf("./vocab_count -verbose 2 -max-vocab 100000 -min-count 10 < corpus.txt > vocab.txt\n");
+        printf("./vocab_count -verbose 2 -max-vocab 100000 -min-count 10 -threads 16 -corpus-file corpus.txt > vocab.txt\n");
+        printf("./vocab_count -verbose 2 -max-vocab 100000 -min-count 10 -merge vocab_day1.txt vocab_day2.txt > vocab.txt\n");
+        printf("./vocab_count -verbose 2 -max-vocab 400000 -approx 4000000 -error-file vocab.err < corpus.txt > vocab.txt\n");
         return 0;
     }
 
@@ -217,6 +1091,20 @@ int main(int argc, char **argv) {
     if ((i = find_arg((char *)"-verbose", argc, argv)) > 0) verbose = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-max-vocab", argc, argv)) > 0) max_vocab = atoll(argv[i + 1]);
     if ((i = find_arg((char *)"-min-count", argc, argv)) > 0) min_count = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-corpus-file", argc, argv)) > 0) corpus_file = argv[i + 1];
+    if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-approx", argc, argv)) > 0) approx_size = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-error-file", argc, argv)) > 0) error_file = argv[i + 1];
+    if ((i = find_arg((char *)"-memory", argc, argv)) > 0) memory_limit = atof(argv[i + 1]);
+    if ((i = find_arg((char *)"-temp-file", argc, argv)) > 0) file_head = argv[i + 1];
+    if ((i = find_arg((char *)"-phrase-file", argc, argv)) > 0) phrase_file = argv[i + 1];
+    if ((i = find_arg((char *)"-binary-vocab", argc, argv)) > 0) binary_vocab_file = argv[i + 1];
+    if ((i = find_arg((char *)"-merge", argc, argv)) > 0) {
+        merge_files = argv + i + 1;
+        num_merge_files = argc - i - 1;
+        approx_size = 0;
+    }
+    if (num_threads < 1) num_threads = 1;
     return get_counts();
 }
 
@@ -0,0 +1,128 @@
+//  Benchmark of the vocabulary hash table in common.c against the chained
+//  move-to-front table (HASHREC/bitwisehash) it replaced.
+//
+//  Usage: ./build/bench corpus.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../../src/common.h"
+
+/* Legacy table, as previously used by vocab_count.c and cooccur.c */
+typedef struct hashrec {
+    char *word;
+    long long num;
+    struct hashrec *next;
+} HASHREC;
+
+unsigned int bitwisehash(char *word, int tsize, unsigned int seed) {
+    char c;
+    unsigned int h;
+    h = seed;
+    for ( ; (c = *word) != '\0'; word++) h ^= ((h << 5) + c + (h >> 2));
+    return (unsigned int)((h & 0x7fffffff) % tsize);
+}
+
+HASHREC **inithashtable() {
+    return (HASHREC **) calloc(TSIZE, sizeof(HASHREC *));
+}
+
+HASHREC *hashsearch(HASHREC **ht, char *w) {
+    HASHREC *htmp, *hprv;
+    unsigned int hval = bitwisehash(w, TSIZE, SEED);
+    for (hprv = NULL, htmp = ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
+    if (htmp != NULL && hprv != NULL) { // move to front on access
+        hprv->next = htmp->next;
+        htmp->next = ht[hval];
+        ht[hval] = htmp;
+    }
+    return htmp;
+}
+
+void hashinsert(HASHREC **ht, char *w) {
+    HASHREC *htmp = hashsearch(ht, w);
+    unsigned int hval;
+    if (htmp != NULL) {htmp->num++; return;}
+    hval = bitwisehash(w, TSIZE, SEED);
+    htmp = (HASHREC *) malloc(sizeof(HASHREC));
+    htmp->word = (char *) malloc(strlen(w) + 1);
+    strcpy(htmp->word, w);
+    htmp->num = 1;
+    htmp->next = ht[hval];
+    ht[hval] = htmp;
+}
+
+void free_table(HASHREC **ht) {
+    int i;
+    HASHREC *current, *tmp;
+    for (i = 0; i < TSIZE; i++) {
+        for (current = ht[i]; current != NULL; ) {
+            tmp = current;
+            current = current->next;
+            free(tmp->word);
+            free(tmp);
+        }
+    }
+    free(ht);
+}
+
+double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    CORPUSREADER corpus;
+    HASHREC **legacy;
+    HASHTABLE *table;
+    char *token, *words, **starts;
+    int len, flag;
+    long long i, num = 0, size = 0, cap = 1 << 20, maxnum = 1 << 16, found;
+    double t;
+
+    if (argc != 2) {
+        printf("Usage: %s corpus.txt\n", argv[0]);
+        return 1;
+    }
+    if (corpus_open(&corpus, argv[1]) != 0) return log_file_loading_error("corpus file", argv[1]);
+
+    /* Copy the tokens to null-terminated strings, so both tables are timed on the same input */
+    words = malloc(cap);
+    starts = malloc(maxnum * sizeof(char *));
+    while ((flag = corpus_next_token(&corpus, &token, &len)) != EOF) {
+        if (flag) continue;
+        if (size + len + 1 > cap) words = realloc(words, cap *= 2);
+        if (num == maxnum) starts = realloc(starts, (maxnum *= 2) * sizeof(char *));
+        memcpy(words + size, token, len);
+        words[size + len] = '\0';
+        starts[num++] = (char *) size;
+        size += len + 1;
+    }
+    corpus_close(&corpus);
+    for (i = 0; i < num; i++) starts[i] = words + (long long) starts[i];
+    printf("%lld tokens\n", num);
+
+    t = seconds();
+    legacy = inithashtable();
+    for (i = 0; i < num; i++) hashinsert(legacy, starts[i]);
+    printf("chained table:       insert %.3fs", seconds() - t);
+    t = seconds();
+    for (i = 0, found = 0; i < num; i++) found += hashsearch(legacy, starts[i]) != NULL;
+    printf(", search %.3fs (%lld found)\n", seconds() - t, found);
+    free_table(legacy);
+
+    t = seconds();
+    table = hashtable_create(TSIZE);
+    for (i = 0; i < num; i++) hashtable_insert(table, starts[i], strlen(starts[i]))->num++;
+    printf("open addressing:     insert %.3fs", seconds() - t);
+    t = seconds();
+    for (i = 0, found = 0; i < num; i++) found += hashtable_search(table, starts[i], strlen(starts[i])) != NULL;
+    printf(", search %.3fs (%lld found), %lld unique words\n", seconds() - t, found, table->count);
+    hashtable_free(table);
+
+    free(words);
+    free(starts);
+    return 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/bash
+set -e
+
+make
+
+CORPUS=tmp.txt
+
+python gen_corpus.py
+
+build/bench $CORPUS
+
+rm tmp.txt
+rm build -r
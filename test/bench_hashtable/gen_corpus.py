@@ -0,0 +1,17 @@
+import random
+
+CORPUS_SIZE = 10000000
+TOKEN_VOCAB_SIZE = 50000000
+CHANCE_LINE_BREAK = 50
+
+# Zipfian token frequencies with a long tail of rare words
+weights = [1.0 / (rank + 1) for rank in range(TOKEN_VOCAB_SIZE)]
+tokens = random.choices(range(TOKEN_VOCAB_SIZE), weights, k=CORPUS_SIZE)
+
+with open("tmp.txt", "w") as wf:
+    for x in tokens:
+        wf.write(f"w{x}")
+        if random.randint(1, CHANCE_LINE_BREAK) == 1:
+            wf.write("\n")
+        else:
+            wf.write(" ")
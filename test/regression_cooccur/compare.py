@@ -0,0 +1,15 @@
+import struct
+import sys
+
+# Compaction sums duplicates in a different order, so counts may differ in the last bits
+def open_cooccur(filename):
+    with open(filename, 'rb') as rf:
+        return list(struct.iter_unpack('iid', rf.read()))
+
+a = open_cooccur(sys.argv[1])
+b = open_cooccur(sys.argv[2])
+
+if len(a) == len(b) and all(x[:2] == y[:2] and abs(x[2] - y[2]) <= 1e-12 * abs(y[2]) for x, y in zip(a, b)):
+    print("Compacted cooccur match! Regression ok")
+else:
+    print("Failed regression test on cooccur compaction")
@@ -20,14 +20,51 @@ WINDOW_SIZE=5
 
 python gen_corpus.py
 
-$NEW_BUILDDIR/vocab_count -min-count $VOCAB_MIN_COUNT -verbose $VERBOSE < $CORPUS > $NEW_VOCAB_FILE
-$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE < $CORPUS > $NEW_COOCCURRENCE_FILE
+$NEW_BUILDDIR/vocab_count -min-count $VOCAB_MIN_COUNT -verbose $VERBOSE -phrase-file new_phrases.txt -binary-vocab new_vocab.bin < $CORPUS > $NEW_VOCAB_FILE
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -ids-out new_corpus.ids < $CORPUS > $NEW_COOCCURRENCE_FILE
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -ids-in new_corpus.ids > new_cooccurrence_ids.bin
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -phrase-file new_phrases.txt -verbose $VERBOSE -window-size $WINDOW_SIZE < $CORPUS > new_cooccurrence_phrases.bin
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file new_vocab.bin -verbose $VERBOSE -window-size $WINDOW_SIZE < $CORPUS > new_cooccurrence_binary.bin
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -overflow-length 100000 < $CORPUS > new_cooccurrence_runs.bin
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -overflow-length 100000 -merge-threads 3 < $CORPUS > new_cooccurrence_ranges.bin
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -overflow-length 100000 -compact-runs 0 < $CORPUS > new_cooccurrence_nocompact.bin
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -overflow-length 100000 -compact-runs 2 < $CORPUS > new_cooccurrence_compact.bin
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -distance-weighting 0 < $CORPUS > new_cooccurrence_unweighted.bin
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -distance-weighting 0 -counter-bytes 4 < $CORPUS > new_cooccurrence_uint.bin
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -distance-weighting 0 -counter-bytes 4 -overflow-length 100000 -checkpoint 0.001 < $CORPUS > new_cooccurrence_checkpoint.bin
+# Kill a run with checkpoints once one lists temporary files; resuming it must count the same as a run left alone
+interrupt() {
+    "$@" -checkpoint 0.001 <&0 > /dev/null 2>&1 &
+    PID=$!
+    while [ ! -f overflow_0005.bin ] && kill -0 $PID 2> /dev/null; do sleep 0.01; done
+    touch resume_marker
+    while ! [ overflow_checkpoint.bin -nt resume_marker ] && kill -0 $PID 2> /dev/null; do sleep 0.01; done
+    kill -9 $PID 2> /dev/null
+    wait $PID 2> /dev/null
+    rm -f resume_marker
+}
+RESUME="-memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -distance-weighting 0 -counter-bytes 4 -overflow-length 100000 -max-product 200000 -compact-runs 4"
+$NEW_BUILDDIR/cooccur $RESUME < <(cat $CORPUS $CORPUS $CORPUS) > new_cooccurrence_pipe.bin
+interrupt $NEW_BUILDDIR/cooccur $RESUME < <(cat $CORPUS $CORPUS $CORPUS)
+$NEW_BUILDDIR/cooccur $RESUME -resume 1 < <(cat $CORPUS $CORPUS $CORPUS) > new_cooccurrence_pipe_resumed.bin
+interrupt $NEW_BUILDDIR/cooccur $RESUME -ids-in new_corpus.ids -threads 3
+$NEW_BUILDDIR/cooccur $RESUME -ids-in new_corpus.ids -threads 3 -resume 1 > new_cooccurrence_ids_resumed.bin
+LEFT_OVER=$(ls overflow_* 2> /dev/null)
+
+SAMPLING="-memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -distance-weighting 0 -counter-bytes 4 -subsample 1e-3 -dynamic-window 1 -corpus-file $CORPUS"
+$NEW_BUILDDIR/cooccur $SAMPLING -seed 7 > new_cooccurrence_sampled.bin
+$NEW_BUILDDIR/cooccur $SAMPLING -seed 7 -threads 3 > new_cooccurrence_sampled_threads.bin
+$NEW_BUILDDIR/cooccur $SAMPLING -seed 7 > new_cooccurrence_sampled_again.bin
+printf "$WINDOW_SIZE 1 1 new_cooccurrence_config1.bin\n$WINDOW_SIZE 1 0 new_cooccurrence_config2.bin\n" > new_configs.txt
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -configs new_configs.txt < $CORPUS
 
 $OLD_BUILDDIR/vocab_count -min-count $VOCAB_MIN_COUNT -verbose $VERBOSE < $CORPUS > $OLD_VOCAB_FILE
 $OLD_BUILDDIR/cooccur -memory $MEMORY -vocab-file $OLD_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE < $CORPUS > $OLD_COOCCURRENCE_FILE
+$NEW_BUILDDIR/cooccur -memory $MEMORY -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -max-product 200000 -overflow-length 60000000 < $CORPUS > new_cooccurrence_sparse.bin
+$OLD_BUILDDIR/cooccur -memory $MEMORY -vocab-file $OLD_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -max-product 200000 -overflow-length 60000000 < $CORPUS > old_cooccurrence_sparse.bin
 
 DIFF_VOCAB=$(diff new_vocab.txt old_vocab.txt);
-DIFF_COOCCUR=$(diff new_cooccurrence.bin old_cooccurrence.bin);
+DIFF_COOCCUR=$(diff new_cooccurrence.bin old_cooccurrence.bin; diff new_cooccurrence_phrases.bin old_cooccurrence.bin; diff new_cooccurrence_binary.bin old_cooccurrence.bin; diff new_cooccurrence_ids.bin old_cooccurrence.bin; diff new_cooccurrence_ranges.bin new_cooccurrence_runs.bin; diff new_cooccurrence_uint.bin new_cooccurrence_unweighted.bin; diff new_cooccurrence_checkpoint.bin new_cooccurrence_uint.bin; diff new_cooccurrence_pipe_resumed.bin new_cooccurrence_pipe.bin; diff new_cooccurrence_ids_resumed.bin new_cooccurrence_uint.bin; printf "%s" "$LEFT_OVER"; diff new_cooccurrence_sampled_threads.bin new_cooccurrence_sampled.bin; diff new_cooccurrence_sampled_again.bin new_cooccurrence_sampled.bin; diff new_cooccurrence_config1.bin old_cooccurrence.bin; diff new_cooccurrence_config2.bin new_cooccurrence_unweighted.bin; diff new_cooccurrence_sparse.bin old_cooccurrence_sparse.bin);
 
 if [ "$DIFF_VOCAB" == "" ];
 then
@@ -43,7 +80,20 @@ else
     echo "Failed regression test on cooccur"
 fi
 
+python compare.py new_cooccurrence_compact.bin new_cooccurrence_nocompact.bin
+
+# The memory plan must fit in -memory, and refuse a -memory that can't hold the tables asked for
+$NEW_BUILDDIR/cooccur -memory 0.1 -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -threads 4 -dry-run 1 2> new_dry_run.txt
+DRY_RUN_STATUS=$?
+$NEW_BUILDDIR/cooccur -memory 0.1 -vocab-file $NEW_VOCAB_FILE -verbose $VERBOSE -window-size $WINDOW_SIZE -overflow-length 50000000 -dry-run 1 2> /dev/null || DRY_RUN_REFUSED=1
+if [ "$DRY_RUN_STATUS" == 0 ] && [ "$DRY_RUN_REFUSED" == 1 ] && grep -q "predicted peak memory" new_dry_run.txt && awk '/predicted peak memory/ {exit !($4 <= 0.1 * 1024 && $7 <= 0.1 * 1024)}' new_dry_run.txt;
+then
+    echo "Memory plan within -memory! Regression ok"
+else
+    echo "Failed regression test on the memory plan"
+fi
+
 rm tmp.txt
-rm new_vocab.txt new_cooccurrence.bin
-rm old_vocab.txt old_cooccurrence.bin 
+rm new_vocab.txt new_vocab.bin new_phrases.txt new_cooccurrence.bin new_cooccurrence_phrases.bin new_cooccurrence_binary.bin new_corpus.ids new_cooccurrence_ids.bin new_cooccurrence_runs.bin new_cooccurrence_ranges.bin new_cooccurrence_compact.bin new_cooccurrence_nocompact.bin new_cooccurrence_unweighted.bin new_cooccurrence_uint.bin new_cooccurrence_checkpoint.bin new_cooccurrence_pipe.bin new_cooccurrence_pipe_resumed.bin new_cooccurrence_ids_resumed.bin new_cooccurrence_sampled.bin new_cooccurrence_sampled_threads.bin new_cooccurrence_sampled_again.bin new_cooccurrence_sparse.bin new_configs.txt new_dry_run.txt new_cooccurrence_config1.bin new_cooccurrence_config2.bin
+rm old_vocab.txt old_cooccurrence.bin old_cooccurrence_sparse.bin 
 rm build -r
\ No newline at end of file
@@ -15,4 +15,17 @@ $BUILDDIR/vocab_count -min-count $VOCAB_MIN_COUNT -verbose $VERBOSE < $CORPUS >
 
 python compare.py
 
-rm correct_vocab_count.txt vocab.txt tmp.txt
\ No newline at end of file
+$BUILDDIR/vocab_count -min-count $VOCAB_MIN_COUNT -verbose $VERBOSE -threads 4 -corpus-file $CORPUS > vocab_threads.txt
+cmp vocab.txt vocab_threads.txt && echo "Threaded vocab identical!"
+
+$BUILDDIR/vocab_count -min-count $VOCAB_MIN_COUNT -verbose $VERBOSE -memory 0.0001 < $CORPUS > vocab_spill.txt
+cmp vocab.txt vocab_spill.txt && echo "Spilled vocab identical!"
+(ulimit -n 64 && $BUILDDIR/vocab_count -min-count $VOCAB_MIN_COUNT -verbose $VERBOSE -memory 0.0001 < $CORPUS > vocab_spill_files.txt)
+cmp vocab.txt vocab_spill_files.txt && echo "Spilled vocab with more runs than open files identical!"
+
+split -n l/3 $CORPUS shard_
+for SHARD in shard_a?; do $BUILDDIR/vocab_count -verbose 0 < $SHARD > $SHARD.vocab; done
+$BUILDDIR/vocab_count -min-count $VOCAB_MIN_COUNT -verbose $VERBOSE -merge shard_a?.vocab > vocab_merged.txt
+cmp vocab.txt vocab_merged.txt && echo "Merged vocab identical!"
+
+rm correct_vocab_count.txt vocab.txt vocab_threads.txt vocab_spill.txt vocab_spill_files.txt vocab_merged.txt shard_a* tmp.txt
\ No newline at end of file